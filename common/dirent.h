@@ -12,6 +12,14 @@
 // This is especially important for network folders.
 //
 
+#if !defined(_WIN32) && defined(FS_SYSTEM_DIRENT)
+//
+// The POSIX file system backend (FsPosix.c) wants the C library's
+// <dirent.h>, not this replacement
+//
+#include_next <dirent.h>
+#else
+
 #ifndef _XDIRENT_H_
 #define _XDIRENT_H_
 
@@ -42,64 +50,74 @@ extern "C" {
 // Caches queries for speedup, esp on network folders.
 //
 
+struct obstack;
+struct dir_walk;
+
 //
 // Dir cache
 //
 struct cache_dir {
-    struct cache_dir *cd_next;
+    struct cache_dir *cd_next; // LRU order, most recent last
+    struct cache_dir *cd_prev;
     struct cache_entry *cd_entry_first;
     struct cache_entry *cd_entry_last;
     char *cd_dirname;
     char *cd_pat;
+    struct cache_dir *cd_hash_next; // next in the same hash bucket
+    unsigned int cd_hash; // case-folded hash of cd_dirname
+    struct cache_entry **cd_index; // name index, NULL if walk incomplete
+    unsigned int cd_index_mask; // # index slots - 1
+    unsigned int cd_nentries; // # entries in the index
+    struct dir_walk *cd_walk; // walk in progress (streaming), else NULL
+    struct obstack *cd_arena; // entries and strings for this dir
+    size_t cd_bytes; // memory charged to this dir
+    BOOL cd_bCached; // on the dir cache list (else non-cached)
+    int cd_refs; // # open DIRs on this dir
+    unsigned long cd_epoch; // last use, see release_cache_entries()
 };
 
 //
 // Entry cache
 //
+// Kept small: there is one of these per file listed.  Fields that
+// only a few entries ever need live in struct cache_entry_cold, which
+// is allocated on first use.
+//
 struct cache_entry {
     struct cache_entry *ce_next;
     char *ce_filename;
+    char *ce_abspath; // our full path
+    struct cache_entry_cold *ce_cold; // NULL until needed
     uintmax_t ce_size;
     uintmax_t ce_ino; // dirent->d_ino  inode #
     ///////////////////////////////////////////////////
     //
     // FindFirstFile/FindNextFile WIN32_FIND_DATA
     //
-    DWORD dwFileAttributes;
-    //FILETIME ftCreationTime;
-    //FILETIME ftLastAccessTime;
-    //FILETIME ftLastWriteTime;
     time_t ce_atime;
     time_t ce_mtime;
     time_t ce_ctime;
-    DWORD dwReserved0; // reparse tag from FindFileFirst - not in findfirst
-    DWORD dwReserved1; // ??? from FindFileFirst - not in findfirst
-
-    // Requires real Win32 FindFirst
-    CHAR cAlternateFileName[14]; // not in findfirst
-
-    BOOL ce_bGotFullInfo; // did GetFileInformationByHandle()
-    BOOL ce_bIsSymlink; // Reparse point or .LNK file
+    DWORD dwFileAttributes;
 
-    // These require extra query with GetFileInformationByHandle
-    DWORD dwVolumeSerialNumber;
+    // Requires extra query with GetFileInformationByHandle
     DWORD nNumberOfLinks;
     //DWORD nFileIndexHigh; // map to ce_ino
     //DWORD nFileIndexLow;
 
-    ////////////////////////
-    //
-    // Child for target of symlink (if we are a reparse point)
-    //
-    char *ce_abspath; // our full path
-    struct cache_entry *ce_symlink;
-    BOOL ce_bBadSymlink; // TRUE if already tried to follow symlink & failed
+    unsigned short ce_namelen; // strlen(ce_filename)
+    BYTE ce_bGotFullInfo; // did GetFileInformationByHandle()
+    BYTE ce_bIsSymlink; // Reparse point or .LNK file
+};
 
-    ////////////////////////
+//
+// Rarely used per-entry data
+//
+struct cache_entry_cold {
     //
-    // Registry info
+    // Child for target of symlink (if we are a reparse point)
     //
-    DWORD ce_dwRegType; // REG_SZ, etc
+    struct cache_entry *cc_symlink;
+    BOOL cc_bBadSymlink; // TRUE if already tried to follow symlink & failed
 };
 
 #define REG_KEY 255  // synthetic type to mark a registry key
@@ -117,6 +135,7 @@ struct dirent
     ///////////////////////////
     // Extra info (cached)
     struct cache_entry *d_ce;
+    const char      *d_pname;   // the name; see readdir_nocopy()
 };
 
 /*
@@ -130,6 +149,9 @@ typedef struct
     //struct _finddata_t    dd_dta;
     struct cache_dir *dd_cd;  // cache dir
     struct cache_entry *dd_next_entry; // next cache entry
+    BOOL dd_bCached; // holds a ref on dd_cd
+    int dd_errno; // error that cut a streaming walk short
+    char *dd_pat; // filter when dd_cd holds a wider pattern, else NULL
 
     /* dirent struct to return from dir (NOTE: this makes this thread
      * safe as long as only one thread uses a particular DIR struct at
@@ -141,11 +163,29 @@ typedef struct
 PVOID _push_64bitfs();
 void _pop_64bitfs(PVOID pOldState);
 
+#ifndef _WIN32
+//
+// Keep clear of the C library's names in non-WIN32 builds
+//
+#define opendir _xopendir
+#define readdir _xreaddir
+#define readdir_nocopy _xreaddir_nocopy
+#define closedir _xclosedir
+#define rewinddir _xrewinddir
+#define telldir _xtelldir
+#define seekdir _xseekdir
+#endif
+
 DIR* __cdecl opendir (const char*);
 // Variant of opendir that includes the wildcard pattern - for speedup (AEK)
 DIR* __cdecl opendir_with_pat (const char*, const char*, BOOL bCache);
 struct dirent* __cdecl readdir (DIR*);
+// Variant of readdir that leaves d_name empty; use d_pname and d_namlen.
+// The name stays valid until closedir (AEK)
+struct dirent* __cdecl readdir_nocopy (DIR*);
 int __cdecl closedir (DIR*);
+// Start reading a dir that will be opened later (ls -R --jobs=N)
+void __cdecl prefetch_dir (const char*);
 void __cdecl rewinddir (DIR*);
 long __cdecl telldir (DIR*);
 void __cdecl seekdir (DIR*, long);
@@ -174,6 +214,14 @@ void __cdecl seekdir (DIR*, long);
 # define FILE_ATTRIBUTE_DEVICE    0x00000040 // File is a device object
 #endif
 
+#ifndef FILE_ATTRIBUTE_SPARSE_FILE
+# define FILE_ATTRIBUTE_SPARSE_FILE 0x00000200
+#endif
+
+#ifndef FILE_SUPPORTS_SPARSE_FILES // GetVolumeInformation flag
+# define FILE_SUPPORTS_SPARSE_FILES 0x00000040
+#endif
+
 #undef FILE_ATTRIBUTE_ENCRYPTED
 #define FILE_ATTRIBUTE_ENCRYPTED  0x00004000 // BUG: VS6 winnt.h uses 0x40
 
@@ -227,6 +275,13 @@ extern int stat_nocache(const char*, struct xstat *, unsigned long);
 extern int xlstat(const char *, struct xstat *);
 extern int lstat_nocache(const char*, struct xstat *, unsigned long);
 
+//
+// Like stat/lstat, but straight from the d_ce of a readdir() entry
+// (no path lookup).  The DIR must still be open.
+//
+extern int stat_dirent(const struct dirent *, struct xstat *);
+extern int lstat_dirent(const struct dirent *, struct xstat *);
+
 //
 // Read the target of the symbolic link
 //
@@ -240,6 +295,16 @@ extern int _xreadlink(struct xstat *, char *, int);
 
 void PreFilterPath(char* szPath/*inout*/);
 
+//
+// Print the dir and stat cache statistics to stderr (--stats)
+//
+extern void print_cache_stats();
+
+//
+// Release d_ce/st_ce pointers from earlier lookups (--cache-mem)
+//
+extern void release_cache_entries();
+
 //
 // Map and assign the Win32 GetLastError() return value to POSIX errno
 //
@@ -281,6 +346,8 @@ extern BOOL gbComInitialized;
 
 #endif  /* Not _XDIRENT_H_ */
 
+#endif  /* FS_SYSTEM_DIRENT */
+
 /*
 vim:tabstop=4:shiftwidth=4:expandtab
 */
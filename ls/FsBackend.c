@@ -0,0 +1,635 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// File system backends for the opendir/readdir/stat layer (dirent.c)
+//
+// Copyright (c) 2004-2018, U-Tools Software LLC
+// Distributed under GNU General Public License version 2.
+//
+
+//
+// See FsBackend.h.  This file has the backend selection, the Win32
+// backend and the synthetic in-memory backend.  The POSIX backend is
+// in FsPosix.c.
+//
+
+#pragma warning(disable: 4305)  // truncated cast ok basetsd.h POINTER_64 - AEK
+
+#if defined(_MSC_VER) && (_MSC_VER < 1300)  // RIVY
+// For VC6, disable warnings from various standard Windows headers
+// NOTE: #pragma warning(push) ... #pragma warning(pop) is broken/unusable for MSVC 6 (re-enables multiple other warnings)
+#pragma warning(disable: 4068)  // DISABLE: unknown pragma warning
+#pragma warning(disable: 4035)  // DISABLE: no return value warning
+#endif
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#if defined(_MSC_VER) && (_MSC_VER < 1300)  // RIVY
+#pragma warning(default: 4068)  // RESET: unknown pragma warning
+#pragma warning(default: 4035)  // RESET: no return value warning
+#endif
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include <io.h> // for _finddatai64_t
+
+#define NEED_DIRENT_H
+#include "windows-support.h"
+#include "xalloc.h"
+#include "FsBackend.h"
+
+struct fs_backend *gpFsBackend;
+
+extern unsigned int gnMemDepth, gnMemFanout, gnMemFiles; // memory backend
+
+//
+// Pick the backend named by LS_FS_BACKEND (once per run)
+//
+struct fs_backend *
+_SelectFsBackend()
+{
+    const char *sz;
+    unsigned int nDepth, nFanout, nFiles;
+
+    if (gpFsBackend != NULL) {
+        return gpFsBackend;
+    }
+
+    sz = getenv("LS_FS_BACKEND");
+
+    if (sz != NULL && _strnicmp(sz, "memory", 6) == 0 &&
+            (sz[6] == '\0' || sz[6] == ':')) {
+        if (sz[6] == ':' &&
+                sscanf(sz+7, "%u,%u,%u", &nDepth, &nFanout, &nFiles) == 3) {
+            gnMemDepth = nDepth;
+            gnMemFanout = nFanout;
+            gnMemFiles = nFiles;
+        }
+        gpFsBackend = &FsMemoryBackend;
+    } else {
+#ifdef _WIN32
+        gpFsBackend = &FsWin32Backend; // default; also "win32"
+#else
+        gpFsBackend = &FsPosixBackend; // default; also "posix"
+#endif
+    }
+    return gpFsBackend;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// Helpers shared by the synthetic and POSIX backends
+//
+
+//
+// Do a case-insensitive DOS-style wildcard match (ASCII only)
+//
+BOOL
+_FsWildMatch(const char *szPattern, const char *szName)
+{
+    for (;;) {
+        switch (*szPattern) {
+        case '\0':
+            return (*szName == '\0');
+        case '?':
+            if (*szName == '\0') {
+                return FALSE;
+            }
+            break;
+        case '*':
+            do {
+                if (_FsWildMatch(szPattern+1, szName)) { // recurse
+                    return TRUE;
+                }
+            } while (*szName++ != '\0');
+            return FALSE;
+        default:
+            if (toupper((unsigned char)*szPattern)
+                    != toupper((unsigned char)*szName)) {
+                return FALSE;
+            }
+            break;
+        }
+        ++szPattern;
+        ++szName;
+    }
+}
+
+//
+// Return the length of the root prefix of a backslashed path:
+// "C:\" (3), "\\server\share\" (through the slash), or "\" (1).
+// Returns 0 if the path is relative.
+//
+static size_t
+_FsRootLen(const char *szPath)
+{
+    const char *sz;
+
+    if (szPath[0] != '\0' && szPath[1] == ':') {
+        return (szPath[2] == '\\') ? 3 : 2;
+    }
+    if (szPath[0] == '\\' && szPath[1] == '\\') {
+        if ((sz = strchr(szPath+2, '\\')) == NULL) {
+            return strlen(szPath);
+        }
+        if ((sz = strchr(sz+1, '\\')) == NULL) {
+            return strlen(szPath);
+        }
+        return (sz+1) - szPath;
+    }
+    if (szPath[0] == '\\') {
+        return 1;
+    }
+    return 0;
+}
+
+//
+// Like GetFullPathName, but purely lexical: resolve szPath against
+// szCwd and collapse "." and ".." without touching the file system.
+//
+// Paths use backslashes.  Returns the length, or the required size
+// if the buffer is too small.
+//
+DWORD
+_FsLexicalFullPathName(const char *szPath, const char *szCwd,
+    DWORD dwBufLen, char *szBuf)
+{
+    char szTmp[FILENAME_MAX*2+2];
+    char szOut[FILENAME_MAX*2+2];
+    char *sz, *szComp, *szNext;
+    size_t nRoot, n;
+
+    if (strlen(szPath) + strlen(szCwd) + 2 > sizeof(szTmp)) {
+        SetLastError(ERROR_FILENAME_EXCED_RANGE);
+        return 0;
+    }
+    if (_FsRootLen(szPath) == 0) {
+        sprintf(szTmp, "%s\\%s", szCwd, szPath); // relative
+    } else if (szPath[1] == ':' && szPath[2] != '\\') {
+        sprintf(szTmp, "%.2s\\%s", szPath, szPath+2); // "C:foo"
+    } else {
+        strcpy(szTmp, szPath);
+    }
+    for (sz = szTmp; *sz; ++sz) {
+        if (*sz == '/') {
+            *sz = '\\';
+        }
+    }
+
+    nRoot = _FsRootLen(szTmp);
+    memcpy(szOut, szTmp, nRoot);
+    szOut[nRoot] = '\0';
+    if (nRoot > 0 && szOut[nRoot-1] != '\\') {
+        szOut[nRoot++] = '\\';
+        szOut[nRoot] = '\0';
+    }
+
+    for (szComp = szTmp + _FsRootLen(szTmp); *szComp; szComp = szNext) {
+        if ((szNext = strchr(szComp, '\\')) != NULL) {
+            *szNext++ = '\0';
+        } else {
+            szNext = szComp + strlen(szComp);
+        }
+        if (szComp[0] == '\0' || strcmp(szComp, ".") == 0) {
+            continue;
+        }
+        n = strlen(szOut);
+        if (strcmp(szComp, "..") == 0) {
+            //
+            // Pop the last component, never above the root
+            //
+            if (n > nRoot) {
+                szOut[n-1] = (szOut[n-1] == '\\') ? '\0' : szOut[n-1];
+                if ((sz = strrchr(szOut + nRoot, '\\')) != NULL) {
+                    *sz = '\0';
+                } else {
+                    szOut[nRoot] = '\0';
+                }
+            }
+            continue;
+        }
+        if (n > nRoot) {
+            strcat(szOut, "\\");
+        }
+        strcat(szOut, szComp);
+    }
+
+    n = strlen(szOut);
+    if (n + 1 > dwBufLen) {
+        return (DWORD)(n + 1);
+    }
+    strcpy(szBuf, szOut);
+    return (DWORD)n;
+}
+
+#ifdef _WIN32
+//////////////////////////////////////////////////////////////////////////
+//
+// Win32 backend - the live file system
+//
+
+static BOOL
+_Win32GetFileInfo(const char *szFullPath, DWORD dwFileAttributes,
+    BY_HANDLE_FILE_INFORMATION *pbhfi)
+{
+    HANDLE hFile;
+    DWORD dwError;
+
+    //
+    // Open file with 0 access rights.
+    //
+    // FILE_FLAG_BACKUP_SEMANTICS is required to open directories
+    // (not supported on Win9x)
+    //
+    if ((hFile = CreateFile(szFullPath,
+            /*STANDARD_RIGHTS_READ | SYNCHRONIZE*/0,
+            0, 0, OPEN_EXISTING,
+            ((dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ?
+                FILE_FLAG_BACKUP_SEMANTICS : 0),
+            0)) == INVALID_HANDLE_VALUE)  {
+        return FALSE;
+    }
+
+    if (!GetFileInformationByHandle(hFile, pbhfi)) {
+        dwError = GetLastError();
+        CloseHandle(hFile);
+        SetLastError(dwError);
+        return FALSE;
+    }
+
+    CloseHandle(hFile);
+    return TRUE;
+}
+
+static DWORD
+_Win32GetFullPathName(const char *szPath, DWORD dwBufLen, char *szBuf)
+{
+    char *szFilePart=NULL; // unused
+
+    return GetFullPathName(szPath, dwBufLen, szBuf, &szFilePart);
+}
+
+static UINT
+_Win32GetDriveType(const char *szRoot)
+{
+    return GetDriveType(szRoot);
+}
+
+static DWORD
+_Win32GetCompressedFileSize(const char *szPath, DWORD *pdwHigh)
+{
+    typedef DWORD (WINAPI *PFNGETCOMPRESSEDFILESIZE)(
+        LPCTSTR lpFileName,
+        LPDWORD lpFileSizeHigh
+    );
+    static PFNGETCOMPRESSEDFILESIZE pfnGetCompressedFileSize;
+
+    if (!DynaLoad("KERNEL32.DLL", "GetCompressedFileSizeA",
+            (PPFN)&pfnGetCompressedFileSize)) {
+        SetLastError(ERROR_CALL_NOT_IMPLEMENTED); // Win9x
+        return INVALID_FILE_SIZE;
+    }
+    return (*pfnGetCompressedFileSize)(szPath, pdwHigh);
+}
+
+static DWORD
+_Win32GetShortPathName(const char *szLongPath, char *szShortPath,
+    DWORD dwBufLen)
+{
+    return GetShortPathName(szLongPath, szShortPath, dwBufLen);
+}
+
+static BOOL
+_Win32GetVolumeInfo(const char *szRoot, char *szFsName, DWORD dwFsNameLen,
+    DWORD *pdwFsFlags, DWORD *pdwClusterSize)
+{
+    DWORD dwSectorsPerCluster, dwBytesPerSector, dwFree, dwTotal;
+
+    if (!GetVolumeInformation(szRoot, NULL, 0, NULL, NULL, pdwFsFlags,
+            szFsName, dwFsNameLen)) {
+        return FALSE;
+    }
+    *pdwClusterSize = 0; // unknown
+    if (GetDiskFreeSpace(szRoot, &dwSectorsPerCluster, &dwBytesPerSector,
+            &dwFree, &dwTotal)) {
+        *pdwClusterSize = dwSectorsPerCluster * dwBytesPerSector;
+    }
+    return TRUE;
+}
+
+struct fs_backend FsWin32Backend = {
+    "win32",
+    _xfindfirsti64,
+    _xfindnexti64,
+    _xfindclose,
+    _Win32GetFileInfo,
+    _Win32GetFullPathName,
+    _Win32GetDriveType,
+    _Win32GetCompressedFileSize,
+    _Win32GetShortPathName,
+    _Win32GetVolumeInfo
+};
+#endif // _WIN32
+
+//////////////////////////////////////////////////////////////////////////
+//
+// Synthetic in-memory backend
+//
+// Every path names a node in a generated tree, so listings of any
+// size can be timed without touching a disk.  A dir at level L
+// (the root is level 0) holds ".", "..", gnMemFanout subdirs named
+// dirNNN if L < gnMemDepth, and gnMemFiles files named fileNNNNN.dat.
+// Sizes and times are derived from a hash of the name, so repeated
+// runs give identical output.
+//
+
+unsigned int gnMemDepth = 3;
+unsigned int gnMemFanout = 8;
+unsigned int gnMemFiles = 100;
+
+#define MEM_CWD "M:\\"
+#define MEM_VOLUME_SERIAL 0x4D454D31 // 'MEM1'
+#define MEM_BASE_TIME ((time_t)1500000000)
+
+struct mem_find {
+    unsigned int mf_nLevel; // level of the dir being listed
+    unsigned int mf_nNext; // next slot to return
+    BOOL mf_bSingleton; // FindFirst on a file name, not a pattern
+    char mf_szPat[FILENAME_MAX];
+};
+
+//
+// Hash a name case-insensitively (FNV-1a)
+//
+static unsigned __int64
+_MemHash(const char *sz)
+{
+    // Built from 32-bit halves; VC6 has no ULL suffix
+    const unsigned __int64 ui64Prime =
+        ((unsigned __int64)0x100 << 32) | 0x000001b3;
+    unsigned __int64 h = ((unsigned __int64)0xcbf29ce4 << 32) | 0x84222325;
+
+    for (; *sz; ++sz) {
+        h = (h ^ (unsigned char)toupper((unsigned char)*sz)) * ui64Prime;
+    }
+    return h;
+}
+
+//
+// Number of slots in a dir at the given level
+//
+static unsigned int
+_MemSlots(unsigned int nLevel)
+{
+    return 2 + (nLevel < gnMemDepth ? gnMemFanout : 0) + gnMemFiles;
+}
+
+//
+// Fill in the find data for slot i of a dir at the given level
+//
+static void
+_MemFillSlot(unsigned int nLevel, unsigned int i, struct _finddatai64_t *pfd)
+{
+    unsigned int nDirs = (nLevel < gnMemDepth ? gnMemFanout : 0);
+    unsigned __int64 h;
+
+    memset(pfd, 0, sizeof(*pfd));
+    if (i == 0) {
+        strcpy(pfd->name, ".");
+    } else if (i == 1) {
+        strcpy(pfd->name, "..");
+    } else if (i - 2 < nDirs) {
+        sprintf(pfd->name, "dir%03u", i - 2);
+    } else {
+        sprintf(pfd->name, "file%05u.dat", i - 2 - nDirs);
+    }
+
+    h = _MemHash(pfd->name) ^ nLevel;
+    if (i < 2 + nDirs) {
+        pfd->attrib = FILE_ATTRIBUTE_DIRECTORY;
+        pfd->size = 0;
+    } else {
+        pfd->attrib = FILE_ATTRIBUTE_ARCHIVE;
+        pfd->size = (__int64)(h % (1024*1024));
+    }
+    pfd->time_write = MEM_BASE_TIME + (time_t)(h % 10000000);
+    pfd->time_create = pfd->time_write - (time_t)(h % 1000);
+    pfd->time_access = pfd->time_write;
+}
+
+//
+// Look up a name in a dir at the given level.  Returns the slot #,
+// or -1 if there is no such name.
+//
+static int
+_MemLookup(unsigned int nLevel, const char *szName)
+{
+    struct _finddatai64_t fd;
+    unsigned int n, nDirs = (nLevel < gnMemDepth ? gnMemFanout : 0);
+    char szExpect[32];
+
+    if (strcmp(szName, ".") == 0) {
+        return 0;
+    }
+    if (strcmp(szName, "..") == 0) {
+        return 1;
+    }
+    //
+    // Parse the number and make sure the name is spelled exactly so
+    //
+    if (sscanf(szName, "%*1[dD]%*1[iI]%*1[rR]%u", &n) == 1 && n < nDirs) {
+        sprintf(szExpect, "dir%03u", n);
+        if (_FsWildMatch(szExpect, szName)) {
+            return 2 + n;
+        }
+    }
+    if (sscanf(szName, "%*1[fF]%*1[iI]%*1[lL]%*1[eE]%u", &n) == 1
+            && n < gnMemFiles) {
+        _MemFillSlot(nLevel, 2 + nDirs + n, &fd);
+        if (_FsWildMatch(fd.name, szName)) {
+            return 2 + nDirs + n;
+        }
+    }
+    return -1;
+}
+
+//
+// Walk the dir components of an absolute path.  Returns the level
+// of the last dir, with *pszLast pointing at the final component
+// (empty if none).  Returns -1 if a dir component does not exist.
+//
+static int
+_MemWalk(char *szPath, char **pszLast)
+{
+    char *szComp, *sz;
+    unsigned int nLevel = 0;
+    int i;
+
+    szComp = szPath + _FsRootLen(szPath);
+    while ((sz = strchr(szComp, '\\')) != NULL) {
+        *sz = '\0';
+        if (szComp[0] != '\0') {
+            if ((i = _MemLookup(nLevel, szComp)) < 2
+                    || (unsigned int)i >= 2 + gnMemFanout
+                    || nLevel >= gnMemDepth) {
+                return -1;
+            }
+            ++nLevel;
+        }
+        szComp = sz + 1;
+    }
+    *pszLast = szComp;
+    return (int)nLevel;
+}
+
+static int
+_MemFindNext(long handle, struct _finddatai64_t *pfd, BOOL bShowStreams)
+{
+    struct mem_find *mf = (struct mem_find *)handle;
+
+    UNREFERENCED_PARAMETER(bShowStreams);
+
+    if (!mf->mf_bSingleton) {
+        while (mf->mf_nNext < _MemSlots(mf->mf_nLevel)) {
+            _MemFillSlot(mf->mf_nLevel, mf->mf_nNext++, pfd);
+            if (_FsWildMatch(mf->mf_szPat, pfd->name)) {
+                return 0;
+            }
+        }
+    }
+    SetLastError(ERROR_NO_MORE_FILES);
+    return -1;
+}
+
+static long
+_MemFindFirst(const char *szPath, struct _finddatai64_t *pfd,
+    BOOL bShowStreams, DWORD dwType)
+{
+    char szBuf[FILENAME_MAX];
+    struct mem_find *mf;
+    char *szLast;
+    int nLevel, i;
+
+    UNREFERENCED_PARAMETER(dwType);
+
+    lstrcpyn(szBuf, szPath, sizeof(szBuf));
+    if ((nLevel = _MemWalk(szBuf, &szLast)) < 0) {
+        SetLastError(ERROR_PATH_NOT_FOUND);
+        return (long)INVALID_HANDLE_VALUE;
+    }
+    if (szLast[0] == '\0') {
+        SetLastError(ERROR_FILE_NOT_FOUND); // root, like FindFirst("C:\")
+        return (long)INVALID_HANDLE_VALUE;
+    }
+
+    mf = (struct mem_find *)xmalloc(sizeof(*mf));
+    memset(mf, 0, sizeof(*mf));
+    mf->mf_nLevel = (unsigned int)nLevel;
+
+    if (strpbrk(szLast, "?*") != NULL) {
+        lstrcpyn(mf->mf_szPat, szLast, sizeof(mf->mf_szPat));
+        if (_MemFindNext((long)mf, pfd, bShowStreams) == 0) {
+            return (long)mf;
+        }
+    } else if ((i = _MemLookup(mf->mf_nLevel, szLast)) >= 0) {
+        mf->mf_bSingleton = TRUE;
+        _MemFillSlot(mf->mf_nLevel, (unsigned int)i, pfd);
+        return (long)mf;
+    }
+    free(mf);
+    SetLastError(ERROR_FILE_NOT_FOUND);
+    return (long)INVALID_HANDLE_VALUE;
+}
+
+static int
+_MemFindClose(long handle, BOOL bShowStreams)
+{
+    UNREFERENCED_PARAMETER(bShowStreams);
+
+    free((struct mem_find *)handle);
+    return 0;
+}
+
+static BOOL
+_MemGetFileInfo(const char *szFullPath, DWORD dwFileAttributes,
+    BY_HANDLE_FILE_INFORMATION *pbhfi)
+{
+    unsigned __int64 h = _MemHash(szFullPath);
+
+    memset(pbhfi, 0, sizeof(*pbhfi));
+    pbhfi->dwFileAttributes = dwFileAttributes;
+    pbhfi->dwVolumeSerialNumber = MEM_VOLUME_SERIAL;
+    pbhfi->nNumberOfLinks = 1;
+    pbhfi->nFileIndexLow = (DWORD)h;
+    pbhfi->nFileIndexHigh = (DWORD)(h >> 32);
+    return TRUE;
+}
+
+static DWORD
+_MemGetFullPathName(const char *szPath, DWORD dwBufLen, char *szBuf)
+{
+    return _FsLexicalFullPathName(szPath, MEM_CWD, dwBufLen, szBuf);
+}
+
+static UINT
+_MemGetDriveType(const char *szRoot)
+{
+    UNREFERENCED_PARAMETER(szRoot);
+
+    return DRIVE_FIXED; // exercise the full-info paths
+}
+
+static DWORD
+_MemGetCompressedFileSize(const char *szPath, DWORD *pdwHigh)
+{
+    UNREFERENCED_PARAMETER(szPath);
+    UNREFERENCED_PARAMETER(pdwHigh);
+
+    SetLastError(ERROR_NOT_SUPPORTED); // caller uses the logical size
+    return INVALID_FILE_SIZE;
+}
+
+static DWORD
+_MemGetShortPathName(const char *szLongPath, char *szShortPath,
+    DWORD dwBufLen)
+{
+    if (szShortPath != szLongPath) {
+        lstrcpyn(szShortPath, szLongPath, dwBufLen); // names are already short
+    }
+    return (DWORD)strlen(szShortPath);
+}
+
+static BOOL
+_MemGetVolumeInfo(const char *szRoot, char *szFsName, DWORD dwFsNameLen,
+    DWORD *pdwFsFlags, DWORD *pdwClusterSize)
+{
+    UNREFERENCED_PARAMETER(szRoot);
+
+    lstrcpyn(szFsName, "MEMFS", dwFsNameLen);
+    *pdwFsFlags = FILE_CASE_PRESERVED_NAMES;
+    *pdwClusterSize = 4096;
+    return TRUE;
+}
+
+struct fs_backend FsMemoryBackend = {
+    "memory",
+    _MemFindFirst,
+    _MemFindNext,
+    _MemFindClose,
+    _MemGetFileInfo,
+    _MemGetFullPathName,
+    _MemGetDriveType,
+    _MemGetCompressedFileSize,
+    _MemGetShortPathName,
+    _MemGetVolumeInfo
+};
+
+/*
+vim:tabstop=4:shiftwidth=4:expandtab
+*/
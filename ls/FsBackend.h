@@ -0,0 +1,100 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// File system backends for the opendir/readdir/stat layer (dirent.c)
+//
+// Copyright (c) 2004-2018, U-Tools Software LLC
+// Distributed under GNU General Public License version 2.
+//
+
+//
+// dirent.c does all of its file system queries through the backend
+// selected here, so that the caching and listing code can be driven
+// by something other than the live Win32 file system.
+//
+// The backend is chosen once per run by the LS_FS_BACKEND environment
+// variable:
+//
+//   win32                  the real file system (default on Windows)
+//   memory[:D,F,N]         a synthetic tree D levels deep with F subdirs
+//                          and N files per dir (default 3,8,100)
+//   posix                  opendir/fstatat (default elsewhere;
+//                          not available in WIN32 builds)
+//
+// All backends report errors Win32-style via SetLastError().
+//
+
+#pragma once
+
+#ifndef _FSBACKEND_H_
+#define _FSBACKEND_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct fs_backend {
+    const char *fb_szName;
+
+    //
+    // Like _xfindfirsti64/_xfindnexti64/_xfindclose.  szPath is an
+    // absolute path ending in a file name or wildcard pattern.
+    //
+    long (*fb_findfirst)(const char *szPath, struct _finddatai64_t *pfd,
+        BOOL bShowStreams, DWORD dwType);
+    int (*fb_findnext)(long handle, struct _finddatai64_t *pfd,
+        BOOL bShowStreams);
+    int (*fb_findclose)(long handle, BOOL bShowStreams);
+
+    //
+    // Inode, link count and volume serial # for an absolute path
+    //
+    BOOL (*fb_get_file_info)(const char *szFullPath, DWORD dwFileAttributes,
+        BY_HANDLE_FILE_INFORMATION *pbhfi);
+
+    //
+    // Like GetFullPathName, GetDriveType, GetCompressedFileSize
+    // and GetShortPathName
+    //
+    DWORD (*fb_get_full_path_name)(const char *szPath, DWORD dwBufLen,
+        char *szBuf);
+    UINT (*fb_get_drive_type)(const char *szRoot);
+    DWORD (*fb_get_compressed_file_size)(const char *szPath, DWORD *pdwHigh);
+    DWORD (*fb_get_short_path_name)(const char *szLongPath, char *szShortPath,
+        DWORD dwBufLen);
+
+    //
+    // File system name, FILE_xxx feature flags and cluster size of
+    // the volume with root szRoot ("C:\" or "\\server\share\")
+    //
+    BOOL (*fb_get_volume_info)(const char *szRoot, char *szFsName,
+        DWORD dwFsNameLen, DWORD *pdwFsFlags, DWORD *pdwClusterSize);
+};
+
+extern struct fs_backend *gpFsBackend; // NULL until first use
+
+extern struct fs_backend *_SelectFsBackend();
+
+#define FS_BACKEND() (gpFsBackend != NULL ? gpFsBackend : _SelectFsBackend())
+
+extern struct fs_backend FsWin32Backend;
+extern struct fs_backend FsMemoryBackend;
+#ifndef _WIN32
+extern struct fs_backend FsPosixBackend;
+#endif
+
+//
+// Shared by the synthetic and POSIX backends
+//
+extern DWORD _FsLexicalFullPathName(const char *szPath, const char *szCwd,
+    DWORD dwBufLen, char *szBuf);
+extern BOOL _FsWildMatch(const char *szPattern, const char *szName);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _FSBACKEND_H_
+
+/*
+vim:tabstop=4:shiftwidth=4:expandtab
+*/
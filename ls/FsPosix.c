@@ -0,0 +1,348 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// POSIX file system backend for the opendir/readdir/stat layer
+//
+// Copyright (c) 2004-2018, U-Tools Software LLC
+// Distributed under GNU General Public License version 2.
+//
+
+//
+// See FsBackend.h.  Built only for non-WIN32 targets; it maps the
+// FindFirst-style interface used by dirent.c onto opendir/fstatat.
+//
+// Paths arrive with backslashes (dirent.c builds them that way) and
+// are flipped to slashes here.  Symbolic links are reported as their
+// targets; there are no reparse points, streams or short names.
+//
+
+#ifndef _WIN32
+
+#include <windows.h> // Win32 types and SetLastError from the compat layer
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <io.h> // for _finddatai64_t
+
+#define FS_SYSTEM_DIRENT // the C library's opendir, not ours
+#include <dirent.h>
+
+#include "xalloc.h"
+#include "FsBackend.h"
+
+struct posix_find {
+    DIR *pf_pDir; // NULL for a singleton lookup
+    char pf_szPat[FILENAME_MAX];
+};
+
+//
+// Map errno to the closest Win32 error and set it
+//
+static void
+_PosixSetLastError(int err, BOOL bDirPart)
+{
+    DWORD dwError;
+
+    switch (err) {
+    case ENOENT:
+        dwError = bDirPart ? ERROR_PATH_NOT_FOUND : ERROR_FILE_NOT_FOUND;
+        break;
+    case ENOTDIR:
+        dwError = ERROR_PATH_NOT_FOUND;
+        break;
+    case EACCES:
+    case EPERM:
+        dwError = ERROR_ACCESS_DENIED;
+        break;
+    case ENAMETOOLONG:
+        dwError = ERROR_FILENAME_EXCED_RANGE;
+        break;
+    case ENOMEM:
+        dwError = ERROR_NOT_ENOUGH_MEMORY;
+        break;
+    default:
+        dwError = ERROR_GEN_FAILURE;
+        break;
+    }
+    SetLastError(dwError);
+}
+
+//
+// Copy a backslashed path and flip it to slashes
+//
+static BOOL
+_PosixPath(const char *szPath, char *szBuf, size_t nBufLen)
+{
+    char *sz;
+
+    if (strlen(szPath) + 1 > nBufLen) {
+        SetLastError(ERROR_FILENAME_EXCED_RANGE);
+        return FALSE;
+    }
+    strcpy(szBuf, szPath);
+    for (sz = szBuf; *sz; ++sz) {
+        if (*sz == '\\') {
+            *sz = '/';
+        }
+    }
+    return TRUE;
+}
+
+static void
+_PosixFill(const char *szName, const struct stat *pst,
+    struct _finddatai64_t *pfd)
+{
+    memset(pfd, 0, sizeof(*pfd));
+    strncpy(pfd->name, szName, sizeof(pfd->name)-1);
+
+    if (S_ISDIR(pst->st_mode)) {
+        pfd->attrib |= FILE_ATTRIBUTE_DIRECTORY;
+    }
+    if (!(pst->st_mode & S_IWUSR)) {
+        pfd->attrib |= FILE_ATTRIBUTE_READONLY;
+    }
+    if (szName[0] == '.' && strcmp(szName, ".") != 0
+            && strcmp(szName, "..") != 0) {
+        pfd->attrib |= FILE_ATTRIBUTE_HIDDEN; // dot files
+    }
+    if (S_ISREG(pst->st_mode)
+            && (__int64)pst->st_blocks * 512 < (__int64)pst->st_size) {
+        pfd->attrib |= FILE_ATTRIBUTE_SPARSE_FILE; // holes; see --phys-size
+    }
+    if (pfd->attrib == 0) {
+        pfd->attrib = FILE_ATTRIBUTE_ARCHIVE;
+    }
+    pfd->size = S_ISDIR(pst->st_mode) ? 0 : (__int64)pst->st_size;
+    pfd->time_write = pst->st_mtime;
+    pfd->time_access = pst->st_atime;
+    pfd->time_create = pst->st_ctime; // closest thing
+}
+
+static int
+_PosixFindNext(long handle, struct _finddatai64_t *pfd, BOOL bShowStreams)
+{
+    struct posix_find *pf = (struct posix_find *)handle;
+    struct dirent *pde;
+    struct stat st;
+
+    UNREFERENCED_PARAMETER(bShowStreams);
+
+    if (pf->pf_pDir != NULL) {
+        while ((pde = readdir(pf->pf_pDir)) != NULL) {
+            if (!_FsWildMatch(pf->pf_szPat, pde->d_name)) {
+                continue;
+            }
+            if (fstatat(dirfd(pf->pf_pDir), pde->d_name, &st, 0) != 0
+                    && fstatat(dirfd(pf->pf_pDir), pde->d_name, &st,
+                        AT_SYMLINK_NOFOLLOW) != 0) {
+                continue; // vanished
+            }
+            _PosixFill(pde->d_name, &st, pfd);
+            return 0;
+        }
+    }
+    SetLastError(ERROR_NO_MORE_FILES);
+    return -1;
+}
+
+static long
+_PosixFindFirst(const char *szPath, struct _finddatai64_t *pfd,
+    BOOL bShowStreams, DWORD dwType)
+{
+    char szBuf[FILENAME_MAX];
+    struct posix_find *pf;
+    struct stat st;
+    char *szLast;
+
+    UNREFERENCED_PARAMETER(dwType);
+
+    if (!_PosixPath(szPath, szBuf, sizeof(szBuf))) {
+        return (long)INVALID_HANDLE_VALUE;
+    }
+    if ((szLast = strrchr(szBuf, '/')) == NULL || szLast[1] == '\0') {
+        SetLastError(ERROR_FILE_NOT_FOUND); // root, like FindFirst("C:\")
+        return (long)INVALID_HANDLE_VALUE;
+    }
+
+    pf = (struct posix_find *)xmalloc(sizeof(*pf));
+    memset(pf, 0, sizeof(*pf));
+
+    if (strpbrk(szLast+1, "?*") != NULL) {
+        strncpy(pf->pf_szPat, szLast+1, sizeof(pf->pf_szPat)-1);
+        *szLast = '\0';
+        if ((pf->pf_pDir = opendir(szBuf[0] ? szBuf : "/")) == NULL) {
+            _PosixSetLastError(errno, TRUE);
+            free(pf);
+            return (long)INVALID_HANDLE_VALUE;
+        }
+        if (_PosixFindNext((long)pf, pfd, bShowStreams) == 0) {
+            return (long)pf;
+        }
+        closedir(pf->pf_pDir);
+        free(pf);
+        SetLastError(ERROR_FILE_NOT_FOUND);
+        return (long)INVALID_HANDLE_VALUE;
+    }
+
+    if (stat(szBuf, &st) != 0 && lstat(szBuf, &st) != 0) {
+        _PosixSetLastError(errno, FALSE);
+        free(pf);
+        return (long)INVALID_HANDLE_VALUE;
+    }
+    _PosixFill(szLast+1, &st, pfd);
+    return (long)pf; // singleton
+}
+
+static int
+_PosixFindClose(long handle, BOOL bShowStreams)
+{
+    struct posix_find *pf = (struct posix_find *)handle;
+    int iResult = 0;
+
+    UNREFERENCED_PARAMETER(bShowStreams);
+
+    if (pf->pf_pDir != NULL && closedir(pf->pf_pDir) != 0) {
+        _PosixSetLastError(errno, FALSE);
+        iResult = -1;
+    }
+    free(pf);
+    return iResult;
+}
+
+static BOOL
+_PosixGetFileInfo(const char *szFullPath, DWORD dwFileAttributes,
+    BY_HANDLE_FILE_INFORMATION *pbhfi)
+{
+    char szBuf[FILENAME_MAX];
+    struct stat st;
+
+    UNREFERENCED_PARAMETER(dwFileAttributes);
+
+    if (!_PosixPath(szFullPath, szBuf, sizeof(szBuf))) {
+        return FALSE;
+    }
+    if (stat(szBuf, &st) != 0) {
+        _PosixSetLastError(errno, FALSE);
+        return FALSE;
+    }
+    memset(pbhfi, 0, sizeof(*pbhfi));
+    pbhfi->dwVolumeSerialNumber = (DWORD)st.st_dev;
+    pbhfi->nNumberOfLinks = (DWORD)st.st_nlink;
+    pbhfi->nFileIndexLow = (DWORD)st.st_ino;
+    pbhfi->nFileIndexHigh = (DWORD)((unsigned __int64)st.st_ino >> 32);
+    return TRUE;
+}
+
+static DWORD
+_PosixGetFullPathName(const char *szPath, DWORD dwBufLen, char *szBuf)
+{
+    char szCwd[FILENAME_MAX];
+    char *sz;
+
+    if (getcwd(szCwd, sizeof(szCwd)) == NULL) {
+        _PosixSetLastError(errno, TRUE);
+        return 0;
+    }
+    for (sz = szCwd; *sz; ++sz) {
+        if (*sz == '/') {
+            *sz = '\\';
+        }
+    }
+    return _FsLexicalFullPathName(szPath, szCwd, dwBufLen, szBuf);
+}
+
+static UINT
+_PosixGetDriveType(const char *szRoot)
+{
+    UNREFERENCED_PARAMETER(szRoot);
+
+    return DRIVE_FIXED;
+}
+
+static DWORD
+_PosixGetCompressedFileSize(const char *szPath, DWORD *pdwHigh)
+{
+    char szBuf[FILENAME_MAX];
+    unsigned __int64 ui64Size;
+    struct stat st;
+
+    if (!_PosixPath(szPath, szBuf, sizeof(szBuf))) {
+        return INVALID_FILE_SIZE;
+    }
+    if (stat(szBuf, &st) != 0) {
+        _PosixSetLastError(errno, FALSE);
+        return INVALID_FILE_SIZE;
+    }
+    ui64Size = (unsigned __int64)st.st_blocks * 512; // allocated size
+    *pdwHigh = (DWORD)(ui64Size >> 32);
+    SetLastError(NO_ERROR);
+    return (DWORD)ui64Size;
+}
+
+static DWORD
+_PosixGetShortPathName(const char *szLongPath, char *szShortPath,
+    DWORD dwBufLen)
+{
+    if (szShortPath != szLongPath) {
+        strncpy(szShortPath, szLongPath, dwBufLen);
+        szShortPath[dwBufLen-1] = '\0';
+    }
+    return (DWORD)strlen(szShortPath); // no 8.3 names
+}
+
+static BOOL
+_PosixGetVolumeInfo(const char *szRoot, char *szFsName, DWORD dwFsNameLen,
+    DWORD *pdwFsFlags, DWORD *pdwClusterSize)
+{
+    char szBuf[FILENAME_MAX];
+    struct stat st;
+
+    if (!_PosixPath(szRoot, szBuf, sizeof(szBuf))) {
+        return FALSE;
+    }
+    if (stat(szBuf, &st) != 0) {
+        _PosixSetLastError(errno, TRUE);
+        return FALSE;
+    }
+    strncpy(szFsName, "posix", dwFsNameLen);
+    szFsName[dwFsNameLen-1] = '\0';
+    *pdwFsFlags = FILE_CASE_SENSITIVE_SEARCH | FILE_CASE_PRESERVED_NAMES
+        | FILE_SUPPORTS_SPARSE_FILES;
+    *pdwClusterSize = (DWORD)st.st_blksize;
+    return TRUE;
+}
+
+struct fs_backend FsPosixBackend = {
+    "posix",
+    _PosixFindFirst,
+    _PosixFindNext,
+    _PosixFindClose,
+    _PosixGetFileInfo,
+    _PosixGetFullPathName,
+    _PosixGetDriveType,
+    _PosixGetCompressedFileSize,
+    _PosixGetShortPathName,
+    _PosixGetVolumeInfo
+};
+
+#else // _WIN32
+
+//
+// Keep the translation unit non-empty for the nmake build, which
+// compiles ls\*.c (C4206 under /WX)
+//
+typedef int _fs_posix_unused;
+
+#endif // _WIN32
+
+/*
+vim:tabstop=4:shiftwidth=4:expandtab
+*/
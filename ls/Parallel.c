@@ -0,0 +1,101 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// Simple bounded worker pool
+//
+// Copyright (c) 2004-2018, U-Tools Software LLC
+// Distributed under GNU General Public License version 2.
+//
+
+#pragma warning(disable: 4305)  // truncated cast ok basetsd.h POINTER_64 - AEK
+
+#if defined(_MSC_VER) && (_MSC_VER < 1300)  // RIVY
+// For VC6, disable warnings from various standard Windows headers
+// NOTE: #pragma warning(push) ... #pragma warning(pop) is broken/unusable for MSVC 6 (re-enables multiple other warnings)
+#pragma warning(disable: 4068)  // DISABLE: unknown pragma warning
+#pragma warning(disable: 4035)  // DISABLE: no return value warning
+#endif
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#if defined(_MSC_VER) && (_MSC_VER < 1300)  // RIVY
+#pragma warning(default: 4068)  // RESET: unknown pragma warning
+#pragma warning(default: 4035)  // RESET: no return value warning
+#endif
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <process.h> // for _beginthreadex
+
+#include "Parallel.h"
+
+struct parallel_job {
+    LONG volatile pj_lNext; // next item to hand out
+    int pj_nItems;
+    PARALLEL_FN pj_pfn;
+    void *pj_pCtx;
+};
+
+static void
+_ParallelWork(struct parallel_job *pj)
+{
+    LONG i;
+
+    while ((i = InterlockedIncrement((LONG *)&pj->pj_lNext) - 1)
+            < pj->pj_nItems) {
+        (*pj->pj_pfn)(pj->pj_pCtx, (int)i);
+    }
+}
+
+static unsigned __stdcall
+_ParallelThread(void *pv)
+{
+    _ParallelWork((struct parallel_job *)pv);
+    return 0;
+}
+
+void
+_ParallelFor(int nItems, int nThreads, PARALLEL_FN pfn, void *pCtx)
+{
+    HANDLE ahThreads[MAXIMUM_WAIT_OBJECTS];
+    struct parallel_job pj;
+    int i, nStarted = 0;
+
+    pj.pj_lNext = 0;
+    pj.pj_nItems = nItems;
+    pj.pj_pfn = pfn;
+    pj.pj_pCtx = pCtx;
+
+    if (nThreads > nItems) {
+        nThreads = nItems;
+    }
+    if (nThreads > MAXIMUM_WAIT_OBJECTS) {
+        nThreads = MAXIMUM_WAIT_OBJECTS;
+    }
+
+    //
+    // Start the helpers; the caller is worker #0.  If a thread
+    // cannot be created, make do with the ones we have.
+    //
+    for (i = 1; i < nThreads; ++i) {
+        if ((ahThreads[nStarted] = (HANDLE)_beginthreadex(NULL, 0,
+                _ParallelThread, &pj, 0, NULL)) == 0) {
+            break;
+        }
+        ++nStarted;
+    }
+
+    _ParallelWork(&pj);
+
+    if (nStarted > 0) {
+        WaitForMultipleObjects(nStarted, ahThreads, TRUE, INFINITE);
+        for (i = 0; i < nStarted; ++i) {
+            CloseHandle(ahThreads[i]);
+        }
+    }
+}
+
+/*
+vim:tabstop=4:shiftwidth=4:expandtab
+*/
@@ -0,0 +1,36 @@
+//////////////////////////////////////////////////////////////////////////
+//
+// Simple bounded worker pool
+//
+// Copyright (c) 2004-2018, U-Tools Software LLC
+// Distributed under GNU General Public License version 2.
+//
+
+#pragma once
+
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void (*PARALLEL_FN)(void *pCtx, int i);
+
+//
+// Call (*pfn)(pCtx, i) for each i in [0, nItems) using at most
+// nThreads threads, including the caller.  Items are handed out
+// in order but may finish in any order.  Returns when all are done.
+//
+extern void _ParallelFor(int nItems, int nThreads, PARALLEL_FN pfn,
+    void *pCtx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _PARALLEL_H_
+
+/*
+vim:tabstop=4:shiftwidth=4:expandtab
+*/
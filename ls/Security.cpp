@@ -784,6 +784,13 @@ _LoadSecurityDescriptor(struct cache_entry *ce, SD& rsd)
         return FALSE;
     }
 
+    //
+    // Skip if the output does not show security (see plan_queries)
+    //
+    if ((query_plan & QUERY_SECURITY) == 0) {
+        return FALSE;
+    }
+
     //
     // Return hardcoded value if --fast and not a fixed disk
     //
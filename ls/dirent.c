@@ -45,33 +45,142 @@
 #include <mbstring.h>
 
 #include <time.h>
+#include <process.h> // for _beginthreadex
 
 #define NEED_DIRENT_H
 #include "windows-support.h"
 #include "xalloc.h"
 #include "more.h"
+#include "obstack.h"
 //#include "xmbrtowc.h" // for get_codepage()
 #include "ls.h" // for enum show_streams and gbReg
+#include "FsBackend.h"
+#include "Parallel.h"
 
 extern int print_inode;
 extern int phys_size;
 extern int short_names;
+extern unsigned long stat_cache_max;
+extern unsigned long cache_mem_max;
+extern int streaming;
+extern unsigned long fetch_threads;
+extern unsigned long dir_jobs;
+extern unsigned long prefetch_depth;
 
 #undef strrchr
 #define strrchr _mbsrchr // use the multibyte version of strrchr
 
 #pragma warning(disable: 4057) // ignore unsigned char* vs char*
 
+#define obstack_chunk_alloc xmalloc
+#define obstack_chunk_free free
+
+
 //
 // Cache for opendir()
 //
-static struct cache_dir *_dir_first, *_dir_last;
+static struct cache_dir *_dir_first, *_dir_last; // in LRU order
 static struct cache_dir *_dir_nocache; // current non-cached dir
 
 //
-// Partial cache for stat()
+// Memory used by the dir cache, for --cache-mem=SIZE.
+//
+// A dir may be evicted only when no DIR is open on it and no lookup
+// has touched it since ls.c last released its entries, because
+// callers keep d_ce/st_ce pointers into the dir until then.
+//
+static size_t _dir_cache_bytes; // total of cd_bytes for cached dirs
+static unsigned long _dir_epoch; // bumped by release_cache_entries()
+
+//
+// Hash index of the dir cache, keyed by the case-folded dir name.
+// Each bucket chains via cd_hash_next in the same order as the list.
+//
+#define DIR_HASH_MIN 256  // must be a power of two
+
+static struct cache_dir **_dir_hash;
+static unsigned int _dir_hash_size; // # buckets, 0 if none yet
+static unsigned int _dir_hash_count; // # dirs in the index
+
+//
+// Partial cache for stat(), hashed by the case-folded abs path.
+// Each bucket chains via ce_next.
+//
+#define STAT_HASH_MIN 256  // must be a power of two
+
+static struct cache_entry **_stat_hash;
+static unsigned int _stat_hash_size; // # buckets, 0 if none yet
+static unsigned long _stat_count; // # entries in the stat cache
+
+//
+// Negative stat cache: abs paths that FindFirst reported missing
+// (ENOENT/ENOTDIR), so repeated probes skip the file system.  Hashed
+// like the stat cache and never evicted.
+//
+struct neg_entry {
+    struct neg_entry *ne_next; // next in the same hash bucket
+    int ne_errno; // ENOENT or ENOTDIR
+    char ne_szPath[1]; // abs path (variable length)
+};
+
+static struct neg_entry **_neg_hash;
+static unsigned int _neg_hash_size; // # buckets, 0 if none yet
+static unsigned long _neg_count; // # paths in the negative cache
+
+//
+// Link targets already read, keyed by the link's abs path, so that
+// a link seen via several cache entries (dir cache, stat cache, or
+// a dir read again after eviction) is only queried once per run
+//
+struct link_memo {
+    struct link_memo *lm_next; // next in the same hash bucket
+    char *lm_szTarget; // target as read, NULL if the link is bad
+    char lm_szPath[1]; // abs path of the link (variable length)
+};
+
+static struct link_memo **_link_hash;
+static unsigned int _link_hash_size; // # buckets, 0 if none yet
+static unsigned long _link_count; // # links memoized
+
+//
+// Cache statistics for --stats
 //
-static struct cache_entry *_stat_first, *_stat_last;
+static struct cache_stats {
+    unsigned long dir_hits; // opendir served from the dir cache
+    unsigned long dir_misses; // opendir that did FindFirst
+    unsigned long dir_stat_hits; // stat served from a cached dir
+    unsigned long stat_hits; // stat served from the stat cache
+    unsigned long stat_misses; // stat that did FindFirst
+    unsigned long stat_full; // stat not cached because cache was full
+    unsigned long dirent_stats; // stat filled from a readdir() entry
+    unsigned long dir_evictions; // dirs evicted for --cache-mem
+    size_t dir_bytes_peak; // high-water mark of _dir_cache_bytes
+    unsigned long vol_hits; // volume lookups served from _volumes
+    unsigned long phys_skips; // --phys-size queries skipped (see below)
+    unsigned long neg_hits; // FindFirst skipped by the negative cache
+    unsigned long dir_filtered; // opendir pattern filtered from a superset
+    unsigned long dir_supersets; // opendir that fetched "*" instead
+    unsigned long dir_prefetched; // opendir served by a --jobs worker
+    unsigned long link_hits; // link target reads served from _link_hash
+    unsigned long dir_entries; // entries read into cache dirs
+    unsigned long cold_entries; // entries that needed a cache_entry_cold
+} _stats;
+
+//
+// Per-volume properties, fetched once per run
+//
+struct volume_info {
+    struct volume_info *vi_next;
+    UINT vi_uDriveType; // DRIVE_FIXED, DRIVE_REMOTE, ...
+    BOOL vi_bGotFsInfo; // FALSE if GetVolumeInformation failed
+    DWORD vi_dwFsFlags; // FILE_FILE_COMPRESSION, FILE_CASE_SENSITIVE_SEARCH..
+    DWORD vi_dwClusterSize; // 0 if unknown
+    char vi_szFsName[32]; // "NTFS", "FAT32", ...
+    char vi_szRoot[FILENAME_MAX]; // "C:\" or "\\server\share\"
+};
+
+static struct volume_info *_volumes; // few, so a list is fine
+static unsigned int _volume_count;
 
 
 //
@@ -149,26 +258,168 @@ _follow_symlink(struct cache_entry *);
 static int
 _get_full_file_info(char *szPath, struct cache_entry *ce);
 
+//
+// Symlink target of an entry, or NULL if none (yet)
+//
+#define CE_SYMLINK(ce) \
+    ((ce)->ce_cold != NULL ? (ce)->ce_cold->cc_symlink : NULL)
+
+//
+// Return the cold record of an entry, allocating it on first use
+//
+static struct cache_entry_cold *
+_get_cold(struct cache_entry *ce)
+{
+    if (ce->ce_cold == NULL) {
+        ce->ce_cold = (struct cache_entry_cold *)xmalloc(sizeof(*ce->ce_cold));
+        memset(ce->ce_cold, 0, sizeof(*ce->ce_cold));
+        ++_stats.cold_entries;
+    }
+    return ce->ce_cold;
+}
+
+//
+// Should we fetch inode and link info?  Only if the output prints
+// them (query_plan), and then only from a fixed disk unless --slow
+// or -i.
+//
+static BOOL
+_want_full_info(BOOL bFixedDisk)
+{
+    if ((query_plan & QUERY_FULL_INFO) == 0) {
+        return FALSE;
+    }
+    return (!run_fast || bFixedDisk || print_inode);
+}
+
+//
+// Extract the volume root of an absolute path: "C:\",
+// "\\server\share\", or "\" (POSIX backend).  Returns FALSE if none.
+//
+static BOOL
+_volume_root(const char *szFullPath, char *szRoot)
+{
+    const char *sz;
+    size_t n;
+
+    if (szFullPath[0] != '\0' && szFullPath[1] == ':') {
+        szRoot[0] = szFullPath[0];
+        szRoot[1] = ':';
+        szRoot[2] = '\\';
+        szRoot[3] = '\0';
+        return TRUE;
+    }
+    if (szFullPath[0] == '\\' && szFullPath[1] == '\\') {
+        //
+        // \\server\share\ - find the backslash after the share name
+        //
+        if ((sz = _mbschr(szFullPath+2, '\\')) == NULL) {
+            return FALSE;
+        }
+        if ((sz = _mbschr(sz+1, '\\')) == NULL) {
+            sz = szFullPath + strlen(szFullPath);
+        }
+        n = sz - szFullPath;
+        if (n + 2 > FILENAME_MAX) {
+            return FALSE;
+        }
+        memcpy(szRoot, szFullPath, n);
+        szRoot[n] = '\\';
+        szRoot[n+1] = '\0';
+        return TRUE;
+    }
+    if (szFullPath[0] == '\\') {
+        strcpy(szRoot, "\\");
+        return TRUE;
+    }
+    return FALSE;
+}
+
+//
+// Look up the cached properties of the volume holding szFullPath.
+// Returns NULL if the volume has not been seen yet.
+//
+// Main thread only: prefetch_dir may add volumes while the --jobs
+// workers run.  Code that runs on a worker gets the volume of its
+// dir from the dir_walk instead (dw_vi, resolved by the main thread).
+//
+static struct volume_info *
+_find_volume(const char *szFullPath)
+{
+    char szRoot[FILENAME_MAX];
+    struct volume_info *vi;
+
+    if (!_volume_root(szFullPath, szRoot)) {
+        return NULL;
+    }
+    for (vi = _volumes; vi != NULL; vi = vi->vi_next) {
+        if (_mbsicmp(vi->vi_szRoot, szRoot) == 0) {
+            return vi;
+        }
+    }
+    return NULL;
+}
+
+//
+// Get the properties of the volume holding szFullPath, asking the
+// file system the first time a volume is seen
+//
+static struct volume_info *
+_get_volume(const char *szFullPath)
+{
+    struct volume_info *vi;
+
+    if ((vi = _find_volume(szFullPath)) != NULL) {
+        ++_stats.vol_hits;
+        return vi;
+    }
+
+    vi = (struct volume_info *)xmalloc(sizeof(*vi));
+    memset(vi, 0, sizeof(*vi));
+    if (!_volume_root(szFullPath, vi->vi_szRoot)) {
+        free(vi);
+        return NULL;
+    }
+    if (vi->vi_szRoot[0] == '\\' && vi->vi_szRoot[1] == '\\') {
+        vi->vi_uDriveType = DRIVE_REMOTE; // UNC is never "fixed"
+    } else {
+        vi->vi_uDriveType = FS_BACKEND()->fb_get_drive_type(vi->vi_szRoot);
+    }
+    vi->vi_bGotFsInfo = FS_BACKEND()->fb_get_volume_info(vi->vi_szRoot,
+        vi->vi_szFsName, sizeof(vi->vi_szFsName), &vi->vi_dwFsFlags,
+        &vi->vi_dwClusterSize);
+
+    vi->vi_next = _volumes;
+    _volumes = vi;
+    ++_volume_count;
+    return vi;
+}
+
 //
 // Get the physical size of the file.  Returns smaller
 // size for compressed or sparse files.
 //
+// vi is the volume holding szPath, or NULL if unknown.  Skip the
+// round trip on volumes that support neither compression nor sparse
+// files.  Do not test the file's own attributes: WOF compressed files
+// (compact /exe) have neither the compressed nor the sparse attribute,
+// but are smaller on disk.
+//
 static uintmax_t
-_get_phys_size(char *szPath, uintmax_t ui64DefaultSize)
+_get_phys_size(char *szPath, const struct volume_info *vi,
+    uintmax_t ui64DefaultSize)
 {
     DWORD dwLow, dwHigh=0;
 
-    typedef DWORD (WINAPI *PFNGETCOMPRESSEDFILESIZE)(
-        LPCTSTR lpFileName,
-        LPDWORD lpFileSizeHigh
-    );
-    static PFNGETCOMPRESSEDFILESIZE pfnGetCompressedFileSize;
-
     if (gbReg) {
         return ui64DefaultSize;
     }
-    if (!DynaLoad("KERNEL32.DLL", "GetCompressedFileSizeA", &pfnGetCompressedFileSize)) {
-        return ui64DefaultSize; // Win9x
+
+    if (vi != NULL && vi->vi_bGotFsInfo
+            && (vi->vi_dwFsFlags &
+                (FILE_FILE_COMPRESSION|FILE_SUPPORTS_SPARSE_FILES)) == 0) {
+        ++_stats.phys_skips; // not atomic, but only a statistic
+        return ui64DefaultSize;
     }
 
     //
@@ -178,10 +429,11 @@ _get_phys_size(char *szPath, uintmax_t ui64DefaultSize)
         return ui64DefaultSize; // already computed at lower level (streams.c)
     }
 
-    dwLow = (*pfnGetCompressedFileSize)(szPath, &dwHigh);
+    SetLastError(NO_ERROR);
+    dwLow = FS_BACKEND()->fb_get_compressed_file_size(szPath, &dwHigh);
 
     if (dwLow == INVALID_FILE_SIZE && GetLastError() != NO_ERROR) {
-        return ui64DefaultSize; // failed
+        return ui64DefaultSize; // failed (or Win9x)
     }
 
     return _to_unsigned_int64(dwLow, dwHigh);
@@ -194,7 +446,7 @@ _get_short_path(char *szPath)
     if (gbReg) {
         return;
     }
-    GetShortPathName(szPath, szPath, FILENAME_MAX);
+    FS_BACKEND()->fb_get_short_path_name(szPath, szPath, FILENAME_MAX);
 }
 
 //
@@ -343,7 +595,6 @@ static int _IsServerRootPath(char *szPath)
 static int
 _ExpandPath(char *szPath, char *szBuf, size_t dwBufLen)
 {
-    char *szFilePart=NULL; // unused
     size_t n;
 
     n = strlen(szPath) + 1;
@@ -376,7 +627,7 @@ _ExpandPath(char *szPath, char *szBuf, size_t dwBufLen)
             szPath[n-6] = ':';
         }
 
-        n = GetFullPathName(szPath, dwBufLen, szBuf, &szFilePart);
+        n = FS_BACKEND()->fb_get_full_path_name(szPath, dwBufLen, szBuf);
 
         if (szStream) {
             size_t nLenStream;
@@ -450,23 +701,13 @@ int _GetAbsolutePath(char *szFile, char *szFullPath, DWORD dwFullPathLen,
             // Registry is always assumed to be local (fast)
             *pbFixedDrive = TRUE;
         } else {
-            *pbFixedDrive = FALSE;
-            if (szFullPath[1] == ':') { // not a UNC path
-                char szDrive[4];
-                //
-                // If C:\ is a local drive, get full info
-                //
-                szDrive[0] = szFullPath[0];
-                szDrive[1] = szFullPath[1];
-                szDrive[2] = '\\';
-                szDrive[3] = '\0';
-                if (GetDriveType(szDrive) == DRIVE_FIXED) {
-                    //
-                    // We want full info (local disks only unless already set)
-                    //
-                    *pbFixedDrive = TRUE;
-                }
-            }
+            struct volume_info *vi;
+            //
+            // If C:\ is a local drive, get full info
+            // (local disks only unless already set)
+            //
+            vi = _get_volume(szFullPath);
+            *pbFixedDrive = (vi != NULL && vi->vi_uDriveType == DRIVE_FIXED);
         }
     }
 
@@ -600,6 +841,11 @@ done:
     return (*q == '\0') ? TRUE : FALSE;
 }
 
+//
+// Does a dir's pattern list every entry?
+//
+#define ALL_PATTERN(szPat) ((szPat)[0] == '*' && (szPat)[1] == '\0')
+
 static BOOL
 _match_dir(struct cache_dir *cd, BOOL bFile,
     LPCSTR szPath, LPCSTR szPat)
@@ -607,9 +853,10 @@ _match_dir(struct cache_dir *cd, BOOL bFile,
     if (_mbsicmp(cd->cd_dirname, szPath) == 0) {
         if (!bFile) {
             //
-            // Matching against another pattern - must be exact match
+            // Matching against another pattern - must be the same
+            // pattern or "*", which readdir filters (see dd_pat)
             //
-            if (_mbsicmp(szPat, cd->cd_pat) == 0) {
+            if (_mbsicmp(szPat, cd->cd_pat) == 0 || ALL_PATTERN(cd->cd_pat)) {
                 return TRUE;
             }
         } else if (_DosPatternMatch(cd->cd_pat, szPat/*file*/)) {
@@ -622,13 +869,92 @@ _match_dir(struct cache_dir *cd, BOOL bFile,
     return FALSE;
 }
 
+//
+// Hash a path name case-insensitively (FNV-1a over the folded chars).
+//
+// Must agree with _mbsicmp(): names that compare equal must hash equal.
+//
+static unsigned int
+_fold_hash(LPCSTR sz)
+{
+    unsigned int h = 2166136261U;
+    unsigned int mbc;
+
+    //
+    // DOC BUG: _mbsnextc() returns the _current_ multi-byte char
+    //
+    while ((mbc = _mbsnextc(sz)) != '\0') {
+        mbc = _mbctolower(mbc);
+        if (mbc > 0xFF) {
+            h = (h ^ (mbc >> 8)) * 16777619U;
+        }
+        h = (h ^ (mbc & 0xFF)) * 16777619U;
+        sz = _mbsinc(sz);
+    }
+    return h;
+}
+
+//
+// Link a dir into the bucket for its hash, after any dirs already there.
+//
+// Appending keeps the bucket in cache-list order so that lookups
+// return the same dir as a walk of the list would.
+//
+static void
+_dir_hash_link(struct cache_dir **table, unsigned int size,
+    struct cache_dir *cd)
+{
+    struct cache_dir **pcd;
+
+    cd->cd_hash_next = NULL;
+    for (pcd = &table[cd->cd_hash & (size-1)]; *pcd; pcd = &(*pcd)->cd_hash_next)
+        ;
+    *pcd = cd;
+}
+
+//
+// Add a newly cached dir to the hash index, growing it as needed
+//
+static void
+_dir_hash_add(struct cache_dir *cd)
+{
+    cd->cd_hash = _fold_hash(cd->cd_dirname);
+
+    if (_dir_hash_count >= _dir_hash_size) { // keep load factor <= 1
+        struct cache_dir **table, *cd2, *cd3;
+        unsigned int size, i;
+
+        size = (_dir_hash_size == 0) ? DIR_HASH_MIN : _dir_hash_size * 2;
+        table = (struct cache_dir **)xmalloc(size * sizeof(*table));
+        memset(table, 0, size * sizeof(*table));
+        //
+        // Rehash each old bucket in order to preserve the chain order
+        //
+        for (i = 0; i < _dir_hash_size; ++i) {
+            for (cd2 = _dir_hash[i]; cd2; cd2 = cd3) {
+                cd3 = cd2->cd_hash_next;
+                _dir_hash_link(table, size, cd2);
+            }
+        }
+        if (_dir_hash != NULL) {
+            free(_dir_hash);
+        }
+        _dir_hash = table;
+        _dir_hash_size = size;
+    }
+
+    _dir_hash_link(_dir_hash, _dir_hash_size, cd);
+    ++_dir_hash_count;
+}
+
 struct cache_dir *
 _find_cache_dir(LPCSTR szPath, LPCSTR szPat)
 {
     struct cache_dir *cd;
+    unsigned int h;
     BOOL bFile;
 
-    bFile = (_mbspbrk(szPath, "?*") == NULL);
+    bFile = (_mbspbrk(szPat, "?*") == NULL);
 
     //
     // First match against the current non-cached dir
@@ -639,98 +965,1016 @@ _find_cache_dir(LPCSTR szPath, LPCSTR szPat)
         }
     }
     //
-    // Second search the dir cache list
+    // Second search the dir cache via the hash index.
     //
-    for (cd = _dir_first; cd; cd = cd->cd_next) {
-        if (_match_dir(cd, bFile, szPath, szPat)) {
+    // Only dirs with the same folded name share a chain with us, so
+    // the pattern checks in _match_dir are limited to those few.
+    //
+    if (_dir_hash_count == 0) {
+        return NULL;
+    }
+    h = _fold_hash(szPath);
+    for (cd = _dir_hash[h & (_dir_hash_size-1)]; cd; cd = cd->cd_hash_next) {
+        if (cd->cd_hash == h && _match_dir(cd, bFile, szPath, szPat)) {
             return cd;
         }
     }
     return NULL;
 }
 
-//////////////////////////////////////////////////////
+//
+// Should an opendir of szPath with a narrower pattern than "*" fetch
+// "*" instead?  Yes once the dir has already been read with some other
+// pattern: a shell running several globs against the same dir then
+// pays for one more FindFirst, and the rest are served from the cache.
+//
+static BOOL
+_want_superset(LPCSTR szPath)
+{
+    struct cache_dir *cd;
+    unsigned int h;
 
-static void _delete_dir(struct cache_dir *cd);
+    if (_dir_hash_count == 0) {
+        return FALSE;
+    }
+    h = _fold_hash(szPath);
+    for (cd = _dir_hash[h & (_dir_hash_size-1)]; cd; cd = cd->cd_hash_next) {
+        if (cd->cd_hash == h && _mbsicmp(cd->cd_dirname, szPath) == 0) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
 
 //
-// Replacement for opendir()
+// Mark a cached dir as most recently used
 //
-// Called by ls.c
+static void
+_touch_dir(struct cache_dir *cd)
+{
+    if (!cd->cd_bCached) {
+        return;
+    }
+    cd->cd_epoch = _dir_epoch;
+    if (cd == _dir_last) {
+        return;
+    }
+    //
+    // Move to the tail of the LRU list
+    //
+    if (cd->cd_prev != NULL) {
+        cd->cd_prev->cd_next = cd->cd_next;
+    } else {
+        _dir_first = cd->cd_next;
+    }
+    cd->cd_next->cd_prev = cd->cd_prev;
+    cd->cd_prev = _dir_last;
+    cd->cd_next = NULL;
+    _dir_last->cd_next = cd;
+    _dir_last = cd;
+}
+
+//
+// Remove a dir from the dir cache list and the hash index
 //
+static void
+_unlink_dir(struct cache_dir *cd)
+{
+    struct cache_dir **pcd;
 
-static DIR*
-__opendir_with_pat(const char* szPath, const char* szPat, BOOL bCache);
+    if (cd->cd_prev != NULL) {
+        cd->cd_prev->cd_next = cd->cd_next;
+    } else {
+        _dir_first = cd->cd_next;
+    }
+    if (cd->cd_next != NULL) {
+        cd->cd_next->cd_prev = cd->cd_prev;
+    } else {
+        _dir_last = cd->cd_prev;
+    }
+    cd->cd_next = cd->cd_prev = NULL;
 
-DIR*
-opendir(const char* szPath)
-{
-    return opendir_with_pat(szPath, "*", TRUE/*bCache*/);
+    for (pcd = &_dir_hash[cd->cd_hash & (_dir_hash_size-1)]; *pcd;
+            pcd = &(*pcd)->cd_hash_next) {
+        if (*pcd == cd) {
+            *pcd = cd->cd_hash_next;
+            break;
+        }
+    }
+    cd->cd_hash_next = NULL;
+    --_dir_hash_count;
+
+    _dir_cache_bytes -= cd->cd_bytes;
+    cd->cd_bCached = FALSE;
 }
 
-DIR*
-opendir_with_pat(const char* szPath, const char* szPat, BOOL bCache)
+static void _delete_dir(struct cache_dir *cd);
+
+//
+// Evict least-recently-used dirs until under the --cache-mem budget
+//
+static void
+_trim_dir_cache()
 {
-    PVOID pOldState;
-    DIR* pResult;
+    struct cache_dir *cd, *cd2;
 
-    pOldState = _push_64bitfs();
-    pResult = __opendir_with_pat(szPath, szPat, bCache);
-    _pop_64bitfs(pOldState);
-    return pResult;
+    if (_dir_cache_bytes > _stats.dir_bytes_peak) {
+        _stats.dir_bytes_peak = _dir_cache_bytes;
+    }
+    if (cache_mem_max == 0) {
+        return; // no limit
+    }
+    for (cd = _dir_first; cd && _dir_cache_bytes > cache_mem_max; cd = cd2) {
+        cd2 = cd->cd_next;
+        if (cd->cd_refs == 0 && cd->cd_epoch != _dir_epoch) {
+            _unlink_dir(cd);
+            _delete_dir(cd);
+            ++_stats.dir_evictions;
+        }
+    }
 }
 
 //
-// Opendir with wildcard pattern, for network speedup
+// Called by ls.c once it no longer holds d_ce/st_ce pointers
+// from earlier lookups, e.g., when the files table is cleared.
 //
-// Called by glob.c
+// Dirs not touched since then become candidates for eviction.
 //
-static DIR*
-__opendir_with_pat(const char* szPath, const char* szPat, BOOL bCache)
+void
+release_cache_entries()
 {
-    char szBuf[FILENAME_MAX];
-    char szFullDirPath[FILENAME_MAX];
-    char szPatBuf[FILENAME_MAX+10];
-    char* sz;
-    struct cache_dir *cd;
+    ++_dir_epoch;
+}
+
+//
+// Replace the name index of a dir with one of the given size (a power
+// of 2) holding every entry on the list
+//
+static void
+_index_rehash(struct cache_dir *cd, unsigned int size)
+{
+    size_t nOldBytes;
     struct cache_entry *ce;
-    DIR* pDir;
-    long hFind;
-    struct _finddatai64_t fd;
-    BOOL bShowStreams = (show_streams == yes_arg);
-    BOOL bFixedDisk = FALSE;
-    BOOL bGetFullFileInfoOk = TRUE;
+    unsigned int i;
+
+    nOldBytes = (cd->cd_index == NULL) ? 0
+        : (cd->cd_index_mask + 1) * sizeof(*cd->cd_index);
+    if (cd->cd_index != NULL) {
+        free(cd->cd_index);
+    }
+    cd->cd_index = (struct cache_entry **)xmalloc(size * sizeof(*cd->cd_index));
+    memset(cd->cd_index, 0, size * sizeof(*cd->cd_index));
+    cd->cd_index_mask = size - 1;
+    cd->cd_bytes += size * sizeof(*cd->cd_index) - nOldBytes;
+    if (cd->cd_bCached) {
+        _dir_cache_bytes += size * sizeof(*cd->cd_index) - nOldBytes;
+    }
+    for (ce = cd->cd_entry_first; ce; ce = ce->ce_next) {
+        i = _fold_hash(ce->ce_filename) & cd->cd_index_mask;
+        while (cd->cd_index[i] != NULL) {
+            i = (i + 1) & cd->cd_index_mask;
+        }
+        cd->cd_index[i] = ce;
+    }
+}
 
-    //
-    // Delete the previous non-cached dir, if any
-    //
-    if (_dir_nocache != NULL) {
-        _delete_dir(_dir_nocache);
-        _dir_nocache = NULL;
+//
+// Add a new entry to the name index of its dir.
+//
+// Open addressing with linear probing.  Entries are added in list
+// order, so a probe finds the first of any duplicate names, same as
+// a walk of cd_entry_first.  Must be called after the entry is
+// linked on the list and its name is final, and every entry before
+// it must already be in the index.
+//
+static void
+_index_add(struct cache_dir *cd, struct cache_entry *ce)
+{
+    unsigned int size, i;
+
+    ++cd->cd_nentries;
+    size = (cd->cd_index == NULL) ? 0 : cd->cd_index_mask + 1;
+    if (cd->cd_nentries * 2 > size) { // keep load factor <= 1/2
+        //
+        // Grow and rehash the whole list, which includes ce
+        //
+        _index_rehash(cd, (size == 0) ? 16 : size * 2);
+        return;
     }
 
-    lstrcpyn(szBuf, szPath, sizeof(szBuf));
-    //
-    // Change forward slashes to backward slashes
-    //
-    for (sz = szBuf; *sz; ++sz) {
-        if (*sz == '/') {
-            *sz = '\\';
-        }
+    i = _fold_hash(ce->ce_filename) & cd->cd_index_mask;
+    while (cd->cd_index[i] != NULL) {
+        i = (i + 1) & cd->cd_index_mask;
     }
-    //
-    // Strip trailing backslashes
-    //
-    for (--sz; sz > szBuf; --sz) {
-        if (*sz != '\\') {
-            break;
-        }
+    cd->cd_index[i] = ce;
+}
+
+//
+// Look up a file name in a cached dir
+//
+static struct cache_entry *
+_lookup_dir_entry(struct cache_dir *cd, LPCSTR szFile)
+{
+    struct cache_entry *ce;
+    unsigned int i;
+
+    if (cd->cd_index == NULL) { // no entries yet
+        for (ce = cd->cd_entry_first; ce; ce = ce->ce_next) {
+            if (ce->ce_filename[0] == szFile[0] &&
+                    _mbsicmp(ce->ce_filename, szFile) == 0) {
+                return ce;
+            }
+        }
+        return NULL;
+    }
+
+    i = _fold_hash(szFile) & cd->cd_index_mask;
+    for (; (ce = cd->cd_index[i]) != NULL; i = (i + 1) & cd->cd_index_mask) {
+        if (ce->ce_filename[0] == szFile[0] &&
+                _mbsicmp(ce->ce_filename, szFile) == 0) {
+            return ce;
+        }
+    }
+    return NULL;
+}
+
+//////////////////////////////////////////////////////
+
+//
+// Allocate from the arena of a cache dir, charging it to the dir
+//
+static void *
+_arena_alloc(struct cache_dir *cd, size_t n)
+{
+    cd->cd_bytes += n;
+    if (cd->cd_bCached) {
+        _dir_cache_bytes += n;
+    }
+    return obstack_alloc(cd->cd_arena, n);
+}
+
+//
+// Copy a string into the arena of a cache dir
+//
+static char *
+_arena_strdup(struct cache_dir *cd, const char *sz)
+{
+    size_t n = strlen(sz) + 1;
+
+    cd->cd_bytes += n;
+    if (cd->cd_bCached) {
+        _dir_cache_bytes += n;
+    }
+    return (char *)obstack_copy(cd->cd_arena, sz, n);
+}
+
+//
+// Set the name of an entry, copying it into the arena
+//
+static void
+_arena_set_name(struct cache_dir *cd, struct cache_entry *ce, const char *sz)
+{
+    size_t n = strlen(sz);
+
+    cd->cd_bytes += n+1;
+    if (cd->cd_bCached) {
+        _dir_cache_bytes += n+1;
+    }
+    ce->ce_filename = (char *)obstack_copy(cd->cd_arena, sz, n+1);
+    ce->ce_namelen = (unsigned short)n;
+}
+
+//
+// Create a new directory node.
+//
+// The entries and their strings are carved from a per-dir arena
+// so that _delete_dir can free them all at once.
+//
+static struct cache_dir *
+_new_dir(const char *szDir, const char *szPat)
+{
+    struct cache_dir *cd;
+
+    cd = (struct cache_dir *)xmalloc(sizeof(struct cache_dir));
+    memset(cd, 0, sizeof(*cd));
+    cd->cd_bytes = sizeof(*cd) + sizeof(struct obstack);
+    cd->cd_arena = (struct obstack *)xmalloc(sizeof(struct obstack));
+    obstack_begin(cd->cd_arena, 0);
+    cd->cd_dirname = _arena_strdup(cd, szDir);
+    cd->cd_pat = _arena_strdup(cd, szPat);
+    return cd;
+}
+
+static void _delete_dir(struct cache_dir *cd);
+
+//
+// Slow per-entry queries set aside for the worker pool (--threads)
+//
+struct enrich_item {
+    struct cache_entry *ei_ce;
+    char *ei_szPath; // dir\file
+    BOOL ei_bFullInfo; // wants inode and hardlink info
+    int ei_iFullInfo; // result of _get_full_file_info
+    char *ei_szShortName; // result of _get_short_path, if any
+};
+
+struct enrich_list {
+    struct enrich_item *el_aItems;
+    int el_nItems;
+    int el_nAlloc;
+    const struct volume_info *el_vi; // volume of the dir
+};
+
+//
+// State of an enumeration in progress (FindFirst done, FindNext pending)
+//
+struct dir_walk {
+    long dw_hFind;
+    BOOL dw_bShowStreams;
+    BOOL dw_bFixedDisk;
+    BOOL dw_bGetFullFileInfoOk;
+    struct enrich_list *dw_pEnrich; // non-NULL to defer the slow queries
+    const struct volume_info *dw_vi; // volume of the dir, NULL if unknown
+    char dw_szFullDirPath[FILENAME_MAX];
+};
+
+//
+// Queue the slow queries for an entry
+//
+static void
+_defer_entry(struct enrich_list *el, struct cache_entry *ce,
+    const char *szPath, BOOL bFullInfo)
+{
+    struct enrich_item *ei;
+
+    if (el->el_nItems == el->el_nAlloc) {
+        el->el_nAlloc = (el->el_nAlloc == 0) ? 64 : el->el_nAlloc * 2;
+        el->el_aItems = (struct enrich_item *)xrealloc(el->el_aItems,
+            el->el_nAlloc * sizeof(struct enrich_item));
+    }
+    ei = &el->el_aItems[el->el_nItems++];
+    memset(ei, 0, sizeof(*ei));
+    ei->ei_ce = ce;
+    ei->ei_szPath = xstrdup(szPath);
+    ei->ei_bFullInfo = bFullInfo;
+}
+
+//
+// Append a file entry from FindFirst/FindNext to the dir
+//
+static void
+_add_dir_entry(struct cache_dir *cd, struct _finddatai64_t *pfd)
+{
+    struct dir_walk *dw = cd->cd_walk;
+    struct cache_entry *ce;
+    BOOL bFullInfo = FALSE;
+    char *sz;
+
+    ce = (struct cache_entry *)_arena_alloc(cd, sizeof(*ce));
+    memset(ce, 0, sizeof(*ce));
+    ++_stats.dir_entries; // not atomic with --jobs, but only a statistic
+    if (cd->cd_entry_first == NULL) {
+        cd->cd_entry_first = cd->cd_entry_last = ce;
+    } else {
+        cd->cd_entry_last->ce_next = ce;
+        cd->cd_entry_last = ce;
+    }
+    _arena_set_name(cd, ce, pfd->name);
+    ce->ce_size = pfd->size;
+    ce->ce_ino = 1; // requires GetFileInformationByHandle - uintmax_t
+    ce->dwFileAttributes = pfd->attrib; // FILE_ATTRIBUTE_NORMAL maps to 0
+    ce->ce_atime = pfd->time_access;
+    ce->ce_mtime = pfd->time_write;
+    ce->ce_ctime = pfd->time_create;
+    ce->nNumberOfLinks = 1;
+
+    if (dw->dw_bFixedDisk) {
+        ce->dwFileAttributes |= FILE_ATTRIBUTE_FIXED_DISK;
+    }
+
+    // Flag reparse points and .LNK shortcuts as symbolic links
+    if ((ce->dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0 ||
+            _mbsicmp(right(pfd->name, 4), ".lnk") == 0) {
+        ce->ce_bIsSymlink = TRUE;
+    }
+
+    //
+    // If we are reparse point, or need full info,
+    // or phys size, or short names, or ls -l
+    //
+    if ((ce->dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0
+            || gbReg || !run_fast || dw->dw_bFixedDisk || print_inode
+            || phys_size || short_names) {
+        char szBuf2[FILENAME_MAX], szBuf3[FILENAME_MAX];
+        //
+        // Build dir\file
+        //
+        if (strlen(dw->dw_szFullDirPath) + strlen(pfd->name) + 2 < sizeof(szBuf2)) {
+            strcpy(szBuf2, dw->dw_szFullDirPath); // directory path
+            if (*right(szBuf2, 1) != '\\') { // if not already
+                strcat(szBuf2, "\\");
+            }
+            strcat(szBuf2, pfd->name);
+            //
+            // Get the absolute path
+            //
+            if (_GetAbsolutePath(szBuf2, szBuf3, FILENAME_MAX, NULL) >= 0) {
+                //
+                // Squirrel away our abs path for later lookup by security.cpp
+                //
+                ce->ce_abspath = _arena_strdup(cd, szBuf3);
+
+                if (gbReg && (ce->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+                    // For registry keys we must test each regkey explicitly
+                    _follow_symlink(ce);
+                }
+
+                bFullInfo = _want_full_info(dw->dw_bFixedDisk);
+            }
+
+            if (dw->dw_pEnrich != NULL) {
+                //
+                // Leave the rest to the worker pool (see _enrich_dir)
+                //
+                if (bFullInfo || phys_size || short_names) {
+                    _defer_entry(dw->dw_pEnrich, ce, szBuf2, bFullInfo);
+                }
+                return;
+            }
+
+            if (bFullInfo && dw->dw_bGetFullFileInfoOk) {
+                //
+                // Get inode and hardlink info
+                // (requires absolute path)
+                //
+                dw->dw_bGetFullFileInfoOk = (_get_full_file_info(szBuf3, ce) == 0);
+            }
+            //
+            // Get the physical size too if requested
+            //
+            if (phys_size) {
+                ce->ce_size = _get_phys_size(szBuf2, dw->dw_vi,
+                    ce->ce_size);
+            }
+
+            if (short_names) {
+                //
+                // Get the short path, then extract the rightmost
+                // component and stuff it into ce->ce_filename
+                //
+                _get_short_path(szBuf2);
+                if ((sz = strrchr(szBuf2, '\\')) != NULL) {
+                    ++sz;
+                    _arena_set_name(cd, ce, sz);
+                }
+            }
+
+        }
+    }
+
+    //
+    // Index the name for stat() lookups (after any short-name rename)
+    //
+    if (dw->dw_pEnrich == NULL) {
+        _index_add(cd, ce); // else done by _enrich_dir
+    }
+}
+
+//
+// Run the slow queries of one deferred entry.  Called on a pool thread.
+//
+// Touches only the entry itself; the arena is not thread-safe, so any
+// short name is handed back in ei_szShortName for _enrich_dir to copy.
+//
+static void
+_enrich_entry(void *pCtx, int i)
+{
+    struct enrich_item *ei = &((struct enrich_list *)pCtx)->el_aItems[i];
+    struct cache_entry *ce = ei->ei_ce;
+    char szBuf[FILENAME_MAX];
+    PVOID pOldState;
+    char *sz;
+
+    pOldState = _push_64bitfs(); // WOW64 redirection is per-thread
+
+    if (ei->ei_bFullInfo) {
+        ei->ei_iFullInfo = _get_full_file_info(ce->ce_abspath, ce);
+    }
+    if (phys_size) {
+        ce->ce_size = _get_phys_size(ei->ei_szPath,
+            ((struct enrich_list *)pCtx)->el_vi, ce->ce_size);
+    }
+    if (short_names) {
+        lstrcpyn(szBuf, ei->ei_szPath, sizeof(szBuf));
+        _get_short_path(szBuf);
+        if ((sz = strrchr(szBuf, '\\')) != NULL) {
+            ei->ei_szShortName = xstrdup(sz+1);
+        }
+    }
+
+    _pop_64bitfs(pOldState);
+}
+
+//
+// Run the deferred queries of a freshly read dir on up to
+// --threads workers, then fold the results back in list order.
+//
+// The serial loop stops asking for full info after the first
+// failure (e.g., access denied on a share).  The pool cannot know
+// that in advance, so the results past the first failure are
+// thrown away to give the same output as the serial loop.
+//
+static void
+_enrich_dir(struct cache_dir *cd, struct enrich_list *el)
+{
+    struct enrich_item *ei;
+    struct cache_entry *ce;
+    BOOL bGetFullFileInfoOk = TRUE;
+    unsigned int size;
+    int i;
+
+    _ParallelFor(el->el_nItems, (int)fetch_threads, _enrich_entry, el);
+
+    for (i = 0; i < el->el_nItems; ++i) {
+        ei = &el->el_aItems[i];
+        ce = ei->ei_ce;
+        if (ei->ei_bFullInfo) {
+            if (!bGetFullFileInfoOk) {
+                ce->ce_bGotFullInfo = FALSE;
+                ce->nNumberOfLinks = 1;
+                ce->ce_ino = 1;
+            } else if (ei->ei_iFullInfo != 0) {
+                bGetFullFileInfoOk = FALSE;
+            }
+        }
+        if (ei->ei_szShortName != NULL) {
+            _arena_set_name(cd, ce, ei->ei_szShortName);
+            free(ei->ei_szShortName);
+        }
+        free(ei->ei_szPath);
+    }
+    free(el->el_aItems);
+
+    //
+    // Index the names now that any short-name renames are in.  None
+    // of the entries is indexed yet, so build the index in one pass,
+    // sized for the whole list.
+    //
+    cd->cd_nentries = 0;
+    for (ce = cd->cd_entry_first; ce != NULL; ce = ce->ce_next) {
+        ++cd->cd_nentries;
+    }
+    for (size = 16; cd->cd_nentries * 2 > size; size *= 2)
+        ;
+    _index_rehash(cd, size);
+}
+
+//
+// Finish the walk of a dir.  Returns 0 if ok, -1 if the walk was cut
+// short (e.g., network failure) with errno set.
+//
+static int
+_end_walk(struct cache_dir *cd)
+{
+    struct dir_walk *dw = cd->cd_walk;
+    DWORD dwError = GetLastError();
+    int iResult = 0;
+
+    cd->cd_walk = NULL;
+
+    if (dwError != ERROR_NO_MORE_FILES) { // network fail during walk
+        FS_BACKEND()->fb_findclose(dw->dw_hFind, dw->dw_bShowStreams);
+        SetLastError(dwError);
+        MapWin32ErrorToPosixErrno();
+        iResult = -1;
+    } else if (FS_BACKEND()->fb_findclose(dw->dw_hFind,
+            dw->dw_bShowStreams) == -1) {
+        MapWin32ErrorToPosixErrno();
+        iResult = -1;
+    }
+    free(dw);
+    return iResult;
+}
+
+//
+// Fetch the next entry of a dir being walked.
+//
+// Returns 1 if an entry was added, 0 at the end of the dir,
+// or -1 on error with errno set.
+//
+static int
+_walk_next(struct cache_dir *cd)
+{
+    struct _finddatai64_t fd;
+
+    if (cd->cd_walk == NULL) {
+        return 0; // already done
+    }
+    if (FS_BACKEND()->fb_findnext(cd->cd_walk->dw_hFind, &fd,
+            cd->cd_walk->dw_bShowStreams) == -1) {
+        return _end_walk(cd);
+    }
+    _add_dir_entry(cd, &fd);
+    return 1;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+//
+// Normalize a dir name the way opendir keys it: forward slashes
+// become backslashes and trailing backslashes are stripped
+//
+static void
+_dir_key(const char *szPath, char *szBuf, size_t nBufLen)
+{
+    char *sz;
+
+    lstrcpyn(szBuf, szPath, (int)nBufLen);
+    //
+    // Change forward slashes to backward slashes
+    //
+    for (sz = szBuf; *sz; ++sz) {
+        if (*sz == '/') {
+            *sz = '\\';
+        }
+    }
+    //
+    // Strip trailing backslashes
+    //
+    for (--sz; sz > szBuf; --sz) {
+        if (*sz != '\\') {
+            break;
+        }
         if (sz == szBuf+2 && szBuf[1] == ':') {
             break; // stop if C:\ found
         }
-        *sz = '\0';
+        *sz = '\0';
+    }
+}
+
+//
+// Read-ahead of the dirs that ls.c queues (--jobs=N, --prefetch=N)
+//
+// ls.c reports each dir as it queues it (prefetch_dir), and worker
+// threads read the dirs into private, non-cached cache_dirs.  ls.c
+// still opens and prints the dirs one at a time in its own order.
+// opendir then claims the finished dir instead of reading it.  All
+// output stays on the main thread in the serial order, so it is the
+// same with or without --jobs.
+//
+// Workers take the most recently queued dir first, which is the
+// order in which ls.c pops its pending_dirs stack.  If opendir wants
+// a dir that no worker has started, it takes the job back and reads
+// the dir itself.  If a worker is on it, opendir waits.
+//
+// At most --prefetch=N dirs (default PREFETCH_AHEAD per worker) may
+// be read or waiting to be claimed, to bound the memory used on wide
+// trees.  --prefetch alone runs a single worker, so that the I/O of
+// the next dirs overlaps the sorting and printing of this one.
+//
+#define PREFETCH_AHEAD 4
+
+enum prefetch_state { PF_QUEUED, PF_RUNNING, PF_DONE };
+
+struct prefetch_job {
+    struct prefetch_job *pj_next; // newest first
+    enum prefetch_state pj_state;
+    char *pj_szDir; // dir name as keyed by opendir (see _dir_key)
+    char *pj_szFullDirPath; // abs path for FindFirst
+    BOOL pj_bFixedDisk;
+    BOOL pj_bShowStreams;
+    const struct volume_info *pj_vi; // see _find_volume
+    struct cache_dir *pj_cd; // result, NULL if FindFirst failed
+    int pj_iResult; // result of the walk, -1 if cut short
+    int pj_errno; // errno if pj_cd is NULL or pj_iResult < 0
+};
+
+static struct prefetch_job *_prefetch_jobs; // unclaimed jobs
+static unsigned long _prefetch_count; // # unclaimed jobs
+static CRITICAL_SECTION _prefetch_cs; // guards the jobs list and pj_state
+static HANDLE _prefetch_hQueued; // semaphore: one count per job queued
+static HANDLE _prefetch_hSlots; // semaphore: room for finished jobs
+static HANDLE _prefetch_hDone; // auto-reset event: some job finished
+static BOOL _prefetch_bStarted; // tried to start the workers
+static BOOL _prefetch_bOk; // workers are running
+
+//
+// Read a queued dir.  Called on a worker thread.
+//
+// The dir is private to the job until claimed, so the walk runs
+// as for a non-cached dir; the per-entry queries run inline.
+//
+static void
+_read_ahead(struct prefetch_job *pj)
+{
+    char szPatBuf[FILENAME_MAX+10];
+    struct _finddatai64_t fd;
+    struct cache_dir *cd;
+    struct dir_walk *dw;
+    long hFind;
+    int iResult;
+
+    cd = _new_dir(pj->pj_szDir, "*");
+
+    strcpy(szPatBuf, pj->pj_szFullDirPath);
+    if (*right(szPatBuf, 1) != '\\') { // if not already
+        strcat(szPatBuf, "\\");
+    }
+    strcat(szPatBuf, "*");
+
+    if ((hFind = FS_BACKEND()->fb_findfirst(szPatBuf, &fd,
+            pj->pj_bShowStreams, DT_DIR)) == (long)INVALID_HANDLE_VALUE) {
+        MapWin32ErrorToPosixErrno();
+        pj->pj_errno = errno;
+        _delete_dir(cd);
+        return;
+    }
+
+    dw = (struct dir_walk *)xmalloc(sizeof(*dw));
+    memset(dw, 0, sizeof(*dw));
+    dw->dw_hFind = hFind;
+    dw->dw_bShowStreams = pj->pj_bShowStreams;
+    dw->dw_bFixedDisk = pj->pj_bFixedDisk;
+    dw->dw_vi = pj->pj_vi;
+    dw->dw_bGetFullFileInfoOk = TRUE;
+    strcpy(dw->dw_szFullDirPath, pj->pj_szFullDirPath);
+    cd->cd_walk = dw;
+
+    _add_dir_entry(cd, &fd);
+    while ((iResult = _walk_next(cd)) > 0)
+        ;
+
+    pj->pj_cd = cd;
+    pj->pj_iResult = iResult;
+    pj->pj_errno = errno;
+}
+
+static unsigned __stdcall
+_prefetch_thread(void *pv)
+{
+    struct prefetch_job *pj;
+    PVOID pOldState;
+
+    UNREFERENCED_PARAMETER(pv);
+
+    for (;;) {
+        WaitForSingleObject(_prefetch_hQueued, INFINITE);
+        WaitForSingleObject(_prefetch_hSlots, INFINITE);
+
+        EnterCriticalSection(&_prefetch_cs);
+        for (pj = _prefetch_jobs; pj; pj = pj->pj_next) {
+            if (pj->pj_state == PF_QUEUED) {
+                pj->pj_state = PF_RUNNING;
+                break;
+            }
+        }
+        LeaveCriticalSection(&_prefetch_cs);
+
+        if (pj == NULL) { // opendir took it back
+            ReleaseSemaphore(_prefetch_hSlots, 1, NULL);
+            continue;
+        }
+
+        pOldState = _push_64bitfs(); // WOW64 redirection is per-thread
+        _read_ahead(pj);
+        _pop_64bitfs(pOldState);
+
+        EnterCriticalSection(&_prefetch_cs);
+        pj->pj_state = PF_DONE;
+        LeaveCriticalSection(&_prefetch_cs);
+        SetEvent(_prefetch_hDone);
+    }
+    /*NOTREACHED*/
+}
+
+//
+// Start the --jobs workers.  They run until exit.
+//
+static BOOL
+_start_prefetch()
+{
+    HANDLE hThread;
+    unsigned long i;
+    LONG lAhead;
+
+    _prefetch_bStarted = TRUE; // only try once
+
+    lAhead = (LONG)(prefetch_depth != 0 ? prefetch_depth
+        : dir_jobs * PREFETCH_AHEAD);
+
+    InitializeCriticalSection(&_prefetch_cs);
+    _prefetch_hQueued = CreateSemaphore(NULL, 0, 0x7FFFFFFF, NULL);
+    _prefetch_hSlots = CreateSemaphore(NULL, lAhead, lAhead, NULL);
+    _prefetch_hDone = CreateEvent(NULL, FALSE/*bManualReset*/, FALSE, NULL);
+    if (_prefetch_hQueued == NULL || _prefetch_hSlots == NULL
+            || _prefetch_hDone == NULL) {
+        return FALSE;
+    }
+
+    for (i = 0; i < dir_jobs; ++i) {
+        if ((hThread = (HANDLE)_beginthreadex(NULL, 0, _prefetch_thread,
+                NULL, 0, NULL)) == 0) {
+            break; // make do with the ones we have
+        }
+        CloseHandle(hThread);
+    }
+    return (i > 0);
+}
+
+static void
+_free_prefetch_job(struct prefetch_job *pj)
+{
+    free(pj->pj_szDir);
+    free(pj->pj_szFullDirPath);
+    free(pj);
+}
+
+//
+// Queue a dir to be read ahead by a worker.  A no-op unless --jobs=N
+// with N > 1 or --prefetch=N with N > 0.
+//
+// Called by ls.c when it queues a dir for listing.  Any error is
+// left for the later opendir to report.
+//
+void
+prefetch_dir(const char *szPath)
+{
+    char szBuf[FILENAME_MAX], szFullDirPath[FILENAME_MAX];
+    struct prefetch_job *pj;
+    struct cache_dir *cd;
+    BOOL bFixedDisk = FALSE;
+    PVOID pOldState;
+    int iResult;
+
+    //
+    // Streaming reads dirs as they are listed, and registry
+    // keys may be followed as links while read (see _add_dir_entry)
+    //
+    if ((dir_jobs <= 1 && prefetch_depth == 0) || streaming || gbReg) {
+        return;
+    }
+    if (!_prefetch_bStarted) {
+        _prefetch_bOk = _start_prefetch();
+    }
+    if (!_prefetch_bOk) {
+        return;
+    }
+
+    _dir_key(szPath, szBuf, sizeof(szBuf));
+
+    //
+    // Nothing to read if the dir is already in the dir cache
+    //
+    if ((cd = _find_cache_dir(szBuf, "*")) != NULL && cd->cd_bCached) {
+        return;
+    }
+
+    //
+    // Resolve the path and volume here: the volume cache is not
+    // thread-safe
+    //
+    pOldState = _push_64bitfs();
+    iResult = _GetAbsolutePath(szBuf, szFullDirPath, FILENAME_MAX,
+        &bFixedDisk);
+    _pop_64bitfs(pOldState);
+    if (iResult < 0 || strlen(szBuf) + 3 > sizeof(szBuf)
+            || strlen(szFullDirPath) + 3 > sizeof(szFullDirPath)) {
+        return; // let opendir report it
+    }
+
+    pj = (struct prefetch_job *)xmalloc(sizeof(*pj));
+    memset(pj, 0, sizeof(*pj));
+    pj->pj_state = PF_QUEUED;
+    pj->pj_szDir = xstrdup(szBuf);
+    pj->pj_szFullDirPath = xstrdup(szFullDirPath);
+    pj->pj_bFixedDisk = bFixedDisk;
+    pj->pj_vi = _find_volume(szFullDirPath); // added by _GetAbsolutePath
+    //
+    // Do not show streams if --fast on a non-fixed disk
+    //
+    pj->pj_bShowStreams = ((query_plan & QUERY_STREAMS) != 0)
+        && !(run_fast && !bFixedDisk);
+
+    EnterCriticalSection(&_prefetch_cs);
+    pj->pj_next = _prefetch_jobs;
+    _prefetch_jobs = pj;
+    ++_prefetch_count;
+    LeaveCriticalSection(&_prefetch_cs);
+
+    ReleaseSemaphore(_prefetch_hQueued, 1, NULL);
+}
+
+//
+// Claim the read-ahead of a dir for opendir.
+//
+// Returns FALSE if the dir must be read by the caller.  Else returns
+// TRUE with *pcd set to the dir (NULL if FindFirst failed) and
+// *piResult to the result of the walk, with errno set on error.
+//
+static BOOL
+_claim_prefetched(const char *szDir, struct cache_dir **pcd, int *piResult)
+{
+    struct prefetch_job *pj, **ppj;
+    BOOL bRead;
+
+    EnterCriticalSection(&_prefetch_cs);
+    for (ppj = &_prefetch_jobs; (pj = *ppj) != NULL; ppj = &pj->pj_next) {
+        if (_mbsicmp(pj->pj_szDir, szDir) == 0) {
+            break;
+        }
+    }
+    if (pj == NULL) {
+        LeaveCriticalSection(&_prefetch_cs);
+        return FALSE;
+    }
+    //
+    // Unlink it.  A worker that is reading it still holds a pointer.
+    //
+    *ppj = pj->pj_next;
+    --_prefetch_count;
+    bRead = (pj->pj_state != PF_QUEUED);
+    while (pj->pj_state == PF_RUNNING) {
+        LeaveCriticalSection(&_prefetch_cs);
+        WaitForSingleObject(_prefetch_hDone, INFINITE);
+        EnterCriticalSection(&_prefetch_cs);
+    }
+    LeaveCriticalSection(&_prefetch_cs);
+
+    if (!bRead) {
+        _free_prefetch_job(pj); // not started; cheaper to read it here
+        return FALSE;
+    }
+
+    ReleaseSemaphore(_prefetch_hSlots, 1, NULL);
+
+    *pcd = pj->pj_cd;
+    *piResult = pj->pj_iResult;
+    errno = pj->pj_errno;
+    _free_prefetch_job(pj);
+    return TRUE;
+}
+
+//
+// Replacement for opendir()
+//
+// Called by ls.c
+//
+
+static DIR*
+__opendir_with_pat(const char* szPath, const char* szPat, BOOL bCache);
+
+DIR*
+opendir(const char* szPath)
+{
+    return opendir_with_pat(szPath, "*", TRUE/*bCache*/);
+}
+
+DIR*
+opendir_with_pat(const char* szPath, const char* szPat, BOOL bCache)
+{
+    PVOID pOldState;
+    DIR* pResult;
+
+    pOldState = _push_64bitfs();
+    pResult = __opendir_with_pat(szPath, szPat, bCache);
+    _pop_64bitfs(pOldState);
+    return pResult;
+}
+
+//
+// Opendir with wildcard pattern, for network speedup
+//
+// Called by glob.c
+//
+static DIR*
+__opendir_with_pat(const char* szPath, const char* szPat, BOOL bCache)
+{
+    char szBuf[FILENAME_MAX];
+    char szFullDirPath[FILENAME_MAX];
+    char szPatBuf[FILENAME_MAX+10];
+    char* sz;
+    struct cache_dir *cd;
+    struct dir_walk *dw;
+    DIR* pDir;
+    long hFind;
+    struct _finddatai64_t fd;
+    struct enrich_list el;
+    BOOL bShowStreams = ((query_plan & QUERY_STREAMS) != 0);
+    BOOL bFixedDisk = FALSE;
+    BOOL bEnrich;
+    int iResult, iErrno;
+    LPCSTR szWantPat; // pattern asked for, if szPat was widened
+
+    //
+    // Delete the previous non-cached dir, if any
+    //
+    if (_dir_nocache != NULL) {
+        _delete_dir(_dir_nocache);
+        _dir_nocache = NULL;
     }
 
+    _dir_key(szPath, szBuf, sizeof(szBuf));
+
     if (!gbReg) {
         //
         // See if the pattern contains any UNIX-style glob chars
@@ -749,13 +1993,73 @@ __opendir_with_pat(const char* szPath, const char* szPat, BOOL bCache)
     // Return cached dir if available
     //
     if ((cd = _find_cache_dir(szBuf, szPat)) != NULL) {
+        ++_stats.dir_hits;
+        _touch_dir(cd);
+        pDir = xmalloc(sizeof(DIR));
+        memset(pDir, 0, sizeof(*pDir));
+        pDir->dd_cd = cd;
+        pDir->dd_next_entry = cd->cd_entry_first;
+        if (cd->cd_bCached) {
+            pDir->dd_bCached = TRUE;
+            ++cd->cd_refs; // pin until closedir
+        }
+        if (_mbsicmp(cd->cd_pat, szPat) != 0) {
+            ++_stats.dir_filtered;
+            pDir->dd_pat = xstrdup(szPat); // served from a superset
+        }
+        //
+        // Drop any read-ahead of the dir, so that the job does not
+        // hold a --prefetch slot until exit
+        //
+        if (_prefetch_count != 0 && _claim_prefetched(szBuf, &cd, &iResult)
+                && cd != NULL) {
+            _delete_dir(cd);
+        }
+        return pDir;
+    }
+
+    ++_stats.dir_misses;
+
+    //
+    // Take the dir from a --jobs worker if it was queued by prefetch_dir
+    //
+    if (!bCache && ALL_PATTERN(szPat) && _prefetch_count != 0
+            && _claim_prefetched(szBuf, &cd, &iResult)) {
+        ++_stats.dir_prefetched;
+        if (cd == NULL) {
+            return NULL; // FindFirst failed; errno already set
+        }
+        _dir_nocache = cd; // as if read below
+        if (iResult < 0) {
+            return NULL; // walk cut short; errno already set
+        }
         pDir = xmalloc(sizeof(DIR));
-        memset(pDir, 0, sizeof(pDir));
+        memset(pDir, 0, sizeof(*pDir));
         pDir->dd_cd = cd;
         pDir->dd_next_entry = cd->cd_entry_first;
         return pDir;
     }
 
+    //
+    // A read-ahead of the dir is of no use to a cached or filtered
+    // opendir.  Drop it, as for a cache hit above, so that it does
+    // not hold a --prefetch slot until exit.
+    //
+    if (_prefetch_count != 0 && _claim_prefetched(szBuf, &cd, &iResult)
+            && cd != NULL) {
+        _delete_dir(cd);
+    }
+
+    //
+    // Fetch everything instead if other patterns are likely to follow
+    //
+    szWantPat = NULL;
+    if (bCache && !ALL_PATTERN(szPat) && _want_superset(szBuf)) {
+        ++_stats.dir_supersets;
+        szWantPat = szPat;
+        szPat = "*";
+    }
+
     //
     // Get the absolute path of the directory for FindFirst
     //
@@ -781,10 +2085,7 @@ __opendir_with_pat(const char* szPath, const char* szPat, BOOL bCache)
     //
     // Create a new directory node
     //
-    cd = (struct cache_dir *)xmalloc(sizeof(struct cache_dir));
-    memset(cd, 0, sizeof(*cd));
-    cd->cd_dirname = xstrdup(szBuf); // *not* abs path - must match for caching
-    cd->cd_pat = xstrdup(szPat);
+    cd = _new_dir(szBuf, szPat); // *not* abs path - must match for caching
 
     //
     // Append search pattern for FindFirstFile.
@@ -822,12 +2123,10 @@ more_fflush(stdmore);
     // Always guaranteed to return at least "." and "..", otherwise
     // not a directory or not found.
     //
-    if ((hFind = _xfindfirsti64(szPatBuf, &fd, bShowStreams, DT_DIR))
-            == (long)INVALID_HANDLE_VALUE) {
+    if ((hFind = FS_BACKEND()->fb_findfirst(szPatBuf, &fd, bShowStreams,
+            DT_DIR)) == (long)INVALID_HANDLE_VALUE) {
         MapWin32ErrorToPosixErrno();
-        free(cd->cd_dirname);
-        free(cd->cd_pat);
-        free(cd);
+        _delete_dir(cd);
         return NULL;
     }
 
@@ -838,9 +2137,14 @@ more_fflush(stdmore);
         if (_dir_first == NULL) {
             _dir_first = _dir_last = cd;
         } else {
+            cd->cd_prev = _dir_last;
             _dir_last->cd_next = cd;
             _dir_last = cd;
         }
+        _dir_hash_add(cd);
+        cd->cd_bCached = TRUE;
+        cd->cd_epoch = _dir_epoch;
+        _dir_cache_bytes += cd->cd_bytes;
         _dir_nocache = NULL;
     } else {
         //
@@ -849,189 +2153,501 @@ more_fflush(stdmore);
         _dir_nocache = cd;
     }
 
-    do {
+    //
+    // Start the walk with the first entry
+    //
+    dw = (struct dir_walk *)xmalloc(sizeof(*dw));
+    memset(dw, 0, sizeof(*dw));
+    dw->dw_hFind = hFind;
+    dw->dw_bShowStreams = bShowStreams;
+    dw->dw_bFixedDisk = bFixedDisk;
+    dw->dw_bGetFullFileInfoOk = TRUE;
+    dw->dw_vi = _find_volume(szFullDirPath);
+    strcpy(dw->dw_szFullDirPath, szFullDirPath);
+    cd->cd_walk = dw;
+
+    //
+    // With --threads, batch up the slow per-entry queries and run
+    // them concurrently once the whole dir has been read
+    //
+    bEnrich = (fetch_threads > 1 && !gbReg && !(streaming && !bCache));
+    if (bEnrich) {
+        memset(&el, 0, sizeof(el));
+        el.el_vi = dw->dw_vi;
+        dw->dw_pEnrich = &el;
+    }
+
+    _add_dir_entry(cd, &fd);
+
+    if (!(streaming && !bCache)) {
         //
-        // Append each file entry to the dir
+        // Read the rest of the dir now
         //
-        ce = (struct cache_entry *)xmalloc(sizeof(*ce));
-        memset(ce, 0, sizeof(*ce));
-        if (cd->cd_entry_first == NULL) {
-            cd->cd_entry_first = cd->cd_entry_last = ce;
-        } else {
-            cd->cd_entry_last->ce_next = ce;
-            cd->cd_entry_last = ce;
+        while ((iResult = _walk_next(cd)) > 0)
+            ;
+        if (bEnrich) {
+            iErrno = errno;
+            _enrich_dir(cd, &el);
+            errno = iErrno;
         }
-        ce->ce_filename = (char *)xstrdup(fd.name);
-        ce->ce_size = fd.size;
-        ce->ce_ino = 1; // requires GetFileInformationByHandle - uintmax_t
-        ce->dwFileAttributes = fd.attrib; // FILE_ATTRIBUTE_NORMAL maps to 0
-        ce->ce_atime = fd.time_access;
-        ce->ce_mtime = fd.time_write;
-        ce->ce_ctime = fd.time_create;
-        ce->nNumberOfLinks = 1;
-
-        if (bFixedDisk) {
-            ce->dwFileAttributes |= FILE_ATTRIBUTE_FIXED_DISK;
+        if (iResult < 0) {
+            return NULL; // errno already set
         }
+    }
+    //
+    // Else streaming: readdir() fetches the rest as it goes
+    //
 
-        // Flag reparse points and .LNK shortcuts as symbolic links
-        if ((ce->dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0 ||
-                _mbsicmp(right(fd.name, 4), ".lnk") == 0) {
-            ce->ce_bIsSymlink = TRUE;
-        }
+    //
+    // Build and return DIR
+    //
+    pDir = xmalloc(sizeof(DIR));
+    memset(pDir, 0, sizeof(*pDir));
+    pDir->dd_cd = cd;
+    pDir->dd_next_entry = cd->cd_entry_first;
+    if (szWantPat != NULL) {
+        pDir->dd_pat = xstrdup(szWantPat);
+    }
+    if (bCache) {
+        pDir->dd_bCached = TRUE;
+        ++cd->cd_refs; // pin until closedir
+        _trim_dir_cache(); // make room (never evicts us)
+    }
+    return pDir;
+}
 
-        //
-        // If we are reparse point, or need full info,
-        // or phys size, or short names, or ls -l
-        //
-        if ((ce->dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0
-                || gbReg || !run_fast || bFixedDisk || print_inode
-                || phys_size || short_names) {
-            char szBuf2[FILENAME_MAX], szBuf3[FILENAME_MAX];
+static struct dirent*
+_readdir(DIR* pDir, BOOL bCopy)
+{
+    struct cache_entry *ce;
+
+    for (;;) {
+        if ((ce = pDir->dd_next_entry) == NULL) { // if no more files
+            struct cache_dir *cd = pDir->dd_cd;
+            PVOID pOldState;
+            int iResult;
+
+            if (cd->cd_walk == NULL) {
+                return NULL; // end of dir
+            }
             //
-            // Build dir\file
+            // Streaming: fetch the next entry from the file system
             //
-            if (strlen(szFullDirPath) + strlen(fd.name) + 2 < sizeof(szBuf2)) {
-                strcpy(szBuf2, szFullDirPath); // directory path
-                if (*right(szBuf2, 1) != '\\') { // if not already
-                    strcat(szBuf2, "\\");
+            pOldState = _push_64bitfs();
+            iResult = _walk_next(cd);
+            _pop_64bitfs(pOldState);
+            if (iResult <= 0) {
+                if (iResult < 0) {
+                    pDir->dd_errno = errno; // report via closedir
                 }
-                strcat(szBuf2, fd.name);
-                //
-                // Get the absolute path
-                //
-                if (_GetAbsolutePath(szBuf2, szBuf3, FILENAME_MAX, NULL) >= 0) {
-                    //
-                    // Squirrel away our abs path for later lookup by security.cpp
-                    //
-                    ce->ce_abspath = xstrdup(szBuf3);
-
-                    if (gbReg && (ce->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
-                        // For registry keys we must test each regkey explicitly
-                        _follow_symlink(ce);
-                    }
+                return NULL;
+            }
+            ce = cd->cd_entry_last;
+        }
+        if (pDir->dd_pat == NULL
+                || _DosPatternMatch(pDir->dd_pat, ce->ce_filename)) {
+            break;
+        }
+        pDir->dd_next_entry = ce->ce_next; // filtered out
+    }
 
-                    if ((!run_fast || bFixedDisk || print_inode) &&
-                            bGetFullFileInfoOk) {
-                        //
-                        // Get inode and hardlink info
-                        // (requires absolute path)
-                        //
-                        bGetFullFileInfoOk = (_get_full_file_info(szBuf3, ce) == 0);
-                    }
-                }
-                //
-                // Get the physical size too if requested
-                //
-                if (phys_size) {
-                    ce->ce_size = _get_phys_size(szBuf2, ce->ce_size);
-                }
+    pDir->dd_dir.d_ino = ce->ce_ino; // might be 0
+    pDir->dd_dir.d_reclen = 0; // unused
+    pDir->dd_dir.d_type = _MapType(ce);
+    pDir->dd_dir.d_namlen = ce->ce_namelen;
+    if (bCopy) {
+        memcpy(pDir->dd_dir.d_name, ce->ce_filename, ce->ce_namelen+1);
+        pDir->dd_dir.d_pname = pDir->dd_dir.d_name;
+    } else {
+        pDir->dd_dir.d_name[0] = '\0';
+        pDir->dd_dir.d_pname = ce->ce_filename; // pinned until closedir
+    }
+    pDir->dd_dir.d_ce = ce;
 
-                if (short_names) {
-                    //
-                    // Get the short path, then extract the rightmost
-                    // component and stuff it into ce->ce_filename
-                    //
-                    _get_short_path(szBuf2);
-                    if ((sz = strrchr(szBuf2, '\\')) != NULL) {
-                        ++sz;
-                        free(ce->ce_filename);
-                        ce->ce_filename = (char *)xstrdup(sz);
-                    }
-                }
+    // Bump to next
+    pDir->dd_next_entry = ce->ce_next;
+
+    return &pDir->dd_dir;
+}
 
+struct dirent*
+readdir(DIR* pDir)
+{
+    return _readdir(pDir, TRUE/*bCopy*/);
+}
+
+//
+// Like readdir, but hand back a pointer to the cached name in
+// d_pname instead of copying it into d_name
+//
+struct dirent*
+readdir_nocopy(DIR* pDir)
+{
+    return _readdir(pDir, FALSE/*bCopy*/);
+}
+
+
+int closedir(DIR* pDir)
+{
+    int err = pDir->dd_errno;
+
+    if (pDir->dd_bCached) {
+        --pDir->dd_cd->cd_refs; // unpin
+    }
+    if (pDir->dd_pat != NULL) {
+        free(pDir->dd_pat);
+    }
+    memset(pDir, 0, sizeof(*pDir));
+    free(pDir);
+    if (err != 0) {
+        errno = err; // streaming walk was cut short
+        return -1;
+    }
+    return 0;
+}
+
+static void _delete_dir(struct cache_dir *cd)
+{
+    struct cache_entry *ce, *ce2, *ce3;
+
+    if (cd->cd_walk != NULL) { // abandoned streaming walk
+        FS_BACKEND()->fb_findclose(cd->cd_walk->dw_hFind,
+            cd->cd_walk->dw_bShowStreams);
+        free(cd->cd_walk);
+        cd->cd_walk = NULL;
+    }
+
+    //
+    // Free any symlinks and cold records.  These are allocated
+    // individually by _follow_symlink; the entries themselves live
+    // in the arena.
+    //
+    for (ce = cd->cd_entry_first; ce; ce = ce->ce_next) {
+        for (ce2 = CE_SYMLINK(ce); ce2; ce2 = ce3) {
+            ce3 = CE_SYMLINK(ce2);
+            if (ce2->ce_filename != NULL) {
+                free(ce2->ce_filename);
             }
+            if (ce2->ce_abspath != NULL) {
+                free(ce2->ce_abspath);
+            }
+            if (ce2->ce_cold != NULL) {
+                free(ce2->ce_cold);
+            }
+            free(ce2);
         }
-    } while (_xfindnexti64(hFind, &fd, bShowStreams) != -1);
+        if (ce->ce_cold != NULL) {
+            free(ce->ce_cold);
+            ce->ce_cold = NULL;
+        }
+    }
+    cd->cd_entry_first = cd->cd_entry_last = NULL;
+    if (cd->cd_index != NULL) {
+        free(cd->cd_index); cd->cd_index = NULL;
+    }
+    //
+    // Free all entries and strings in one shot
+    //
+    obstack_free(cd->cd_arena, NULL);
+    free(cd->cd_arena);
+    cd->cd_arena = NULL;
+    cd->cd_dirname = cd->cd_pat = NULL;
+    free(cd);
+    return;
+}
 
-    if (GetLastError() != ERROR_NO_MORE_FILES) { // network fail during walk
-        DWORD dwError = GetLastError();
-        _xfindclose(hFind, bShowStreams);
-        SetLastError(dwError);
-        MapWin32ErrorToPosixErrno();
+//////////////////////////////////////////////////////////////////////
+
+//
+// Look up an abs path in the partial stat cache
+//
+static struct cache_entry *
+_lookup_stat_cache(LPCSTR szFullPath)
+{
+    struct cache_entry *ce;
+
+    if (_stat_count == 0) {
         return NULL;
     }
+    ce = _stat_hash[_fold_hash(szFullPath) & (_stat_hash_size-1)];
+    for (; ce; ce = ce->ce_next) {
+        if (_mbsicmp(ce->ce_abspath, szFullPath) == 0) {
+            return ce;
+        }
+    }
+    return NULL;
+}
+
+//
+// Add an entry to the partial stat cache, growing the table as needed.
+//
+// Entries are never evicted: callers keep st_ce pointers to them.
+// Once --stat-cache=N entries are cached, new ones are left uncached.
+//
+static void
+_add_stat_cache(struct cache_entry *ce)
+{
+    struct cache_entry **pce;
+
+    if (stat_cache_max != 0 && _stat_count >= stat_cache_max) {
+        ++_stats.stat_full;
+        return;
+    }
 
-    if (_xfindclose(hFind, bShowStreams) == -1) {
-        MapWin32ErrorToPosixErrno();
-        return NULL;
+    if (_stat_count >= _stat_hash_size) { // keep load factor <= 1
+        struct cache_entry **table, *ce2, *ce3;
+        unsigned int size, i;
+
+        size = (_stat_hash_size == 0) ? STAT_HASH_MIN : _stat_hash_size * 2;
+        table = (struct cache_entry **)xmalloc(size * sizeof(*table));
+        memset(table, 0, size * sizeof(*table));
+        for (i = 0; i < _stat_hash_size; ++i) {
+            for (ce2 = _stat_hash[i]; ce2; ce2 = ce3) {
+                ce3 = ce2->ce_next;
+                pce = &table[_fold_hash(ce2->ce_abspath) & (size-1)];
+                ce2->ce_next = *pce;
+                *pce = ce2;
+            }
+        }
+        if (_stat_hash != NULL) {
+            free(_stat_hash);
+        }
+        _stat_hash = table;
+        _stat_hash_size = size;
     }
 
     //
-    // Build and return DIR
+    // Push on the front of the bucket.  A path is only added after
+    // a lookup missed, so the bucket has no other entry for it.
     //
-    pDir = xmalloc(sizeof(DIR));
-    memset(pDir, 0, sizeof(pDir));
-    pDir->dd_cd = cd;
-    pDir->dd_next_entry = cd->cd_entry_first;
-    return pDir;
+    pce = &_stat_hash[_fold_hash(ce->ce_abspath) & (_stat_hash_size-1)];
+    ce->ce_next = *pce;
+    *pce = ce;
+    ++_stat_count;
 }
 
-struct dirent*
-readdir(DIR* pDir)
+//
+// Look up an abs path in the negative stat cache.  A path under a
+// missing dir is missing too, so the ancestors are checked as well.
+//
+// Returns the cached errno, or 0 if the path may exist.
+//
+static int
+_lookup_neg_cache(LPCSTR szFullPath)
 {
-    struct cache_entry *ce;
-    size_t n;
+    char szBuf[FILENAME_MAX];
+    struct neg_entry *ne;
+    char *sz;
 
-    if ((ce = pDir->dd_next_entry) == NULL) { // if no more files
-        return NULL;
+    if (_neg_count == 0) {
+        return 0;
+    }
+    lstrcpyn(szBuf, szFullPath, FILENAME_MAX);
+    for (;;) {
+        ne = _neg_hash[_fold_hash(szBuf) & (_neg_hash_size-1)];
+        for (; ne; ne = ne->ne_next) {
+            if (_mbsicmp(ne->ne_szPath, szBuf) == 0) {
+                ++_stats.neg_hits;
+                return ne->ne_errno;
+            }
+        }
+        //
+        // Strip the last component, stopping at the volume root
+        //
+        if ((sz = _mbsrchr(szBuf, '\\')) == NULL || sz == szBuf
+                || (sz == szBuf+2 && szBuf[1] == ':')
+                || _IsServerRootPath(szBuf)) {
+            return 0;
+        }
+        *sz = '\0';
     }
+}
 
-    pDir->dd_dir.d_ino = ce->ce_ino; // might be 0
-    pDir->dd_dir.d_reclen = 0; // unused
-    pDir->dd_dir.d_type = _MapType(ce);
-    n = strlen(ce->ce_filename);
-    pDir->dd_dir.d_namlen = (unsigned short)n;
-    memcpy(pDir->dd_dir.d_name, ce->ce_filename, n+1);
-    pDir->dd_dir.d_ce = ce;
+//
+// Remember a failed FindFirst on an abs path (errno set by the caller).
+// dwError is the Win32 error.  Only "does not exist" results are
+// cached; access denied and network errors may be transient (note
+// ERROR_BAD_NETPATH also maps to ENOENT).  Limited by --stat-cache=N
+// like the stat cache.
+//
+static void
+_add_neg_cache(LPCSTR szFullPath, DWORD dwError)
+{
+    struct neg_entry **pne, *ne;
+    size_t len;
 
-    // Bump to next
-    pDir->dd_next_entry = ce->ce_next;
+    if (dwError != ERROR_FILE_NOT_FOUND && dwError != ERROR_PATH_NOT_FOUND) {
+        return;
+    }
+    if (stat_cache_max != 0 && _neg_count >= stat_cache_max) {
+        return;
+    }
 
-    return &pDir->dd_dir;
-}
+    if (_neg_count >= _neg_hash_size) { // keep load factor <= 1
+        struct neg_entry **table, *ne2, *ne3;
+        unsigned int size, i;
 
+        size = (_neg_hash_size == 0) ? STAT_HASH_MIN : _neg_hash_size * 2;
+        table = (struct neg_entry **)xmalloc(size * sizeof(*table));
+        memset(table, 0, size * sizeof(*table));
+        for (i = 0; i < _neg_hash_size; ++i) {
+            for (ne2 = _neg_hash[i]; ne2; ne2 = ne3) {
+                ne3 = ne2->ne_next;
+                pne = &table[_fold_hash(ne2->ne_szPath) & (size-1)];
+                ne2->ne_next = *pne;
+                *pne = ne2;
+            }
+        }
+        if (_neg_hash != NULL) {
+            free(_neg_hash);
+        }
+        _neg_hash = table;
+        _neg_hash_size = size;
+    }
 
-int closedir(DIR* pDir)
-{
-    memset(pDir, 0, sizeof(*pDir));
-    free(pDir);
-    return 0;
+    len = strlen(szFullPath);
+    ne = (struct neg_entry *)xmalloc(sizeof(*ne) + len);
+    ne->ne_errno = errno;
+    memcpy(ne->ne_szPath, szFullPath, len+1);
+
+    pne = &_neg_hash[_fold_hash(szFullPath) & (_neg_hash_size-1)];
+    ne->ne_next = *pne;
+    *pne = ne;
+    ++_neg_count;
 }
 
-static void _delete_dir(struct cache_dir *cd)
+//
+// Look up a link's abs path in the link memo
+//
+static struct link_memo *
+_lookup_link_memo(LPCSTR szFullPath)
 {
-    struct cache_entry *ce, *ce2, *ce3;
+    struct link_memo *lm;
 
-    for (ce = cd->cd_entry_first; ce; ce = ce2) {
-        ce2 = ce->ce_next;
-again:
-        if (ce->ce_filename != NULL) {
-            free(ce->ce_filename); ce->ce_filename = NULL;
+    if (_link_count == 0) {
+        return NULL;
+    }
+    lm = _link_hash[_fold_hash(szFullPath) & (_link_hash_size-1)];
+    for (; lm; lm = lm->lm_next) {
+        if (_mbsicmp(lm->lm_szPath, szFullPath) == 0) {
+            return lm;
         }
-        if (ce->ce_abspath != NULL) {
-            free(ce->ce_abspath); ce->ce_abspath = NULL;
+    }
+    return NULL;
+}
+
+//
+// Add an empty link memo for an abs path, growing the table as needed.
+// Never evicted.
+//
+static struct link_memo *
+_add_link_memo(LPCSTR szFullPath)
+{
+    struct link_memo **plm, *lm;
+    size_t len;
+
+    if (_link_count >= _link_hash_size) { // keep load factor <= 1
+        struct link_memo **table, *lm2, *lm3;
+        unsigned int size, i;
+
+        size = (_link_hash_size == 0) ? STAT_HASH_MIN : _link_hash_size * 2;
+        table = (struct link_memo **)xmalloc(size * sizeof(*table));
+        memset(table, 0, size * sizeof(*table));
+        for (i = 0; i < _link_hash_size; ++i) {
+            for (lm2 = _link_hash[i]; lm2; lm2 = lm3) {
+                lm3 = lm2->lm_next;
+                plm = &table[_fold_hash(lm2->lm_szPath) & (size-1)];
+                lm2->lm_next = *plm;
+                *plm = lm2;
+            }
         }
-        // Also free any symlinks
-        if ((ce3 = ce->ce_symlink) != NULL) {
-            free(ce);
-            ce = ce3;
-            goto again;
+        if (_link_hash != NULL) {
+            free(_link_hash);
         }
-        free(ce);
-    }
-    cd->cd_entry_first = cd->cd_entry_last = NULL;
-    if (cd->cd_dirname != NULL) {
-        free(cd->cd_dirname); cd->cd_dirname = NULL;
+        _link_hash = table;
+        _link_hash_size = size;
     }
-    if (cd->cd_pat != NULL) {
-        free(cd->cd_pat); cd->cd_pat = NULL;
-    }
-    free(cd);
-    return;
+
+    len = strlen(szFullPath);
+    lm = (struct link_memo *)xmalloc(sizeof(*lm) + len);
+    memset(lm, 0, sizeof(*lm));
+    memcpy(lm->lm_szPath, szFullPath, len+1);
+
+    plm = &_link_hash[_fold_hash(szFullPath) & (_link_hash_size-1)];
+    lm->lm_next = *plm;
+    *plm = lm;
+    ++_link_count;
+    return lm;
 }
 
-//////////////////////////////////////////////////////////////////////
+//
+// Print the cache statistics to stderr (--stats)
+//
+void
+print_cache_stats()
+{
+    //
+    // Same layout as PROCESS_MEMORY_COUNTERS in psapi.h (not in VS6)
+    //
+    typedef struct {
+        DWORD cb;
+        DWORD PageFaultCount;
+        size_t PeakWorkingSetSize;
+        size_t WorkingSetSize;
+        size_t QuotaPeakPagedPoolUsage;
+        size_t QuotaPagedPoolUsage;
+        size_t QuotaPeakNonPagedPoolUsage;
+        size_t QuotaNonPagedPoolUsage;
+        size_t PagefileUsage;
+        size_t PeakPagefileUsage;
+    } MEMCOUNTERS;
+    typedef BOOL (WINAPI *PFNGETPROCESSMEMORYINFO)(
+        HANDLE Process,
+        MEMCOUNTERS *ppsmemCounters,
+        DWORD cb
+    );
+    static PFNGETPROCESSMEMORYINFO pfnGetProcessMemoryInfo;
+
+    more_fflush(stdmore);
+    more_fprintf(stdmore_err, "dir cache: %lu hits (%lu filtered), "
+        "%lu misses (%lu widened to *, %lu read ahead), %u dirs\n",
+        _stats.dir_hits, _stats.dir_filtered, _stats.dir_misses,
+        _stats.dir_supersets, _stats.dir_prefetched, _dir_hash_count);
+    more_fprintf(stdmore_err, "stat cache: %lu from readdir, %lu dir hits, "
+        "%lu hits, %lu misses, %lu entries, %lu not cached (full)\n",
+        _stats.dirent_stats, _stats.dir_stat_hits, _stats.stat_hits,
+        _stats.stat_misses, _stat_count, _stats.stat_full);
+    more_fprintf(stdmore_err, "negative stat cache: %lu paths, "
+        "%lu round trips saved\n", _neg_count, _stats.neg_hits);
+    more_fprintf(stdmore_err, "symlinks: %lu read, %lu reads saved\n",
+        _link_count, _stats.link_hits);
+    more_fprintf(stdmore_err, "dir cache memory: %lu KB now, %lu KB peak, "
+        "%lu dirs evicted\n",
+        (unsigned long)(_dir_cache_bytes / 1024),
+        (unsigned long)(_stats.dir_bytes_peak / 1024), _stats.dir_evictions);
+    more_fprintf(stdmore_err, "dir cache entries: %lu read, %u bytes each; "
+        "%lu with cold data, %u bytes each\n",
+        _stats.dir_entries, (unsigned int)sizeof(struct cache_entry),
+        _stats.cold_entries, (unsigned int)sizeof(struct cache_entry_cold));
+    more_fprintf(stdmore_err, "volumes: %u cached, %lu hits, "
+        "%lu --phys-size queries skipped\n",
+        _volume_count, _stats.vol_hits, _stats.phys_skips);
+    //
+    // Peak working set, to help size --cache-mem
+    //
+    if (DynaLoad("PSAPI.DLL", "GetProcessMemoryInfo",
+            &pfnGetProcessMemoryInfo)) {
+        MEMCOUNTERS pmc;
+
+        memset(&pmc, 0, sizeof(pmc));
+        pmc.cb = sizeof(pmc);
+        if ((*pfnGetProcessMemoryInfo)(GetCurrentProcess(), &pmc, sizeof(pmc))) {
+            more_fprintf(stdmore_err, "peak working set: %lu KB\n",
+                (unsigned long)(pmc.PeakWorkingSetSize / 1024));
+        }
+    }
+    more_fflush(stdmore_err);
+}
 
 static int _xstat(const char *szPath, struct xstat *st,
     unsigned long dwType, BOOL bCache, BOOL bFollowSymlink);
@@ -1093,6 +2709,56 @@ _xstat(const char *szPath, struct xstat *st,
     return iResult;
 }
 
+//
+// Fill in a stat from a cache entry
+//
+static void
+_fill_stat(struct cache_entry *ce, struct xstat *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_ino = ce->ce_ino;
+    st->st_size = ce->ce_size;
+    st->st_atime = ce->ce_atime;
+    st->st_mtime = ce->ce_mtime;
+    st->st_ctime = ce->ce_ctime;
+    st->st_nlink = (short)ce->nNumberOfLinks;
+    st->st_mode = _MapMode(ce);
+    st->st_ce = ce;
+}
+
+//
+// Fast path for ls.c: the readdir() entry already points at its
+// cache entry, so skip the path split and dir/stat cache lookups
+//
+static int
+_xstat_dirent(const struct dirent *pde, struct xstat *st,
+    BOOL bFollowSymlink)
+{
+    struct cache_entry *ce = pde->d_ce;
+    PVOID pOldState;
+
+    if (bFollowSymlink) {
+        pOldState = _push_64bitfs();
+        ce = _follow_symlink(ce);
+        _pop_64bitfs(pOldState);
+    }
+    ++_stats.dirent_stats;
+    _fill_stat(ce, st);
+    return 0;
+}
+
+int
+stat_dirent(const struct dirent *pde, struct xstat *st)
+{
+    return _xstat_dirent(pde, st, TRUE/*bFollowSymlink*/);
+}
+
+int
+lstat_dirent(const struct dirent *pde, struct xstat *st)
+{
+    return _xstat_dirent(pde, st, FALSE/*bFollowSymlink*/);
+}
+
 static int
 __xstat(const char *szPath, struct xstat *st,
     unsigned long dwType, BOOL bCache, BOOL bFollowSymlink)
@@ -1104,7 +2770,7 @@ __xstat(const char *szPath, struct xstat *st,
     struct cache_entry *ce;
     long hFind;
     struct _finddatai64_t fd;
-    BOOL bShowStreams = (show_streams == yes_arg);
+    BOOL bShowStreams = ((query_plan & QUERY_STREAMS) != 0);
     BOOL bFixedDisk = FALSE;
 
     lstrcpyn(szFullPath, szPath, FILENAME_MAX);
@@ -1183,17 +2849,22 @@ __xstat(const char *szPath, struct xstat *st,
         //
         // Found hit from previous opendir()/readdir()
         //
-        for (ce = cd->cd_entry_first; ce; ce = ce->ce_next) {
-            if (ce->ce_filename[0] == szFile[0] &&
-                    _mbsicmp(ce->ce_filename, szFile) == 0) {
-                //
-                // Found file
-                //
-                goto cache_hit;
-            }
+        if ((ce = _lookup_dir_entry(cd, szFile)) != NULL) {
+            //
+            // Found file
+            //
+            ++_stats.dir_stat_hits;
+            _touch_dir(cd);
+            goto cache_hit;
         }
-        errno = ENOENT;  // not in cache dir
-        return -1;
+        if (cd->cd_walk == NULL) {
+            errno = ENOENT;  // not in cache dir
+            return -1;
+        }
+        //
+        // Else the dir is still being streamed and the file may
+        // not have been fetched yet - ask the file system
+        //
     }
 
     //
@@ -1208,11 +2879,14 @@ __xstat(const char *szPath, struct xstat *st,
     //
     // Check the partial stat cache against the abs path
     //
-    for (ce = _stat_first; ce; ce = ce->ce_next) {
-        if (ce->ce_abspath && _mbsicmp(ce->ce_abspath, szFullPath) == 0) {
-            goto cache_hit;
-        }
+    if ((ce = _lookup_stat_cache(szFullPath)) != NULL) {
+        ++_stats.stat_hits;
+        goto cache_hit;
     }
+    if ((errno = _lookup_neg_cache(szFullPath)) != 0) {
+        return -1; // known missing
+    }
+    ++_stats.stat_misses;
 
     //
     // Do not show streams if --fast on a non-fixed disk
@@ -1229,10 +2903,10 @@ more_fflush(stdmore);
     //
     // Do a singleton FindFirst to get WIN32_FILE_DATA
     //
-    if ((hFind = _xfindfirsti64(szFullPath, &fd, bShowStreams, dwType))
-            != (long)INVALID_HANDLE_VALUE) {
+    if ((hFind = FS_BACKEND()->fb_findfirst(szFullPath, &fd, bShowStreams,
+            dwType)) != (long)INVALID_HANDLE_VALUE) {
         // Succeeded
-        if (_xfindclose(hFind, bShowStreams) == -1) {
+        if (FS_BACKEND()->fb_findclose(hFind, bShowStreams) == -1) {
             MapWin32ErrorToPosixErrno();
             return -1;
         }
@@ -1255,7 +2929,12 @@ more_fflush(stdmore);
             fd.time_write = t;
             fd.time_create = t;
         } else {
+            DWORD dwError = GetLastError(); // before errno mapping
+
             MapWin32ErrorToPosixErrno();
+            if (bCache) {
+                _add_neg_cache(szFullPath, dwError);
+            }
             return -1;
         }
     }
@@ -1263,22 +2942,11 @@ more_fflush(stdmore);
     ce = (struct cache_entry *)xmalloc(sizeof(*ce));
     memset(ce, 0, sizeof(*ce));
 
-    if (bCache) {
-        //
-        // Put on the partial stat cache
-        //
-        if (_stat_first == NULL) {
-            _stat_first = _stat_last = ce;
-        } else {
-            _stat_last->ce_next = ce;
-            _stat_last = ce;
-        }
-    }
-
     if (short_names) {
         _get_short_path(szFullPath); // update in place
     }
     ce->ce_filename = (char *)xstrdup(fd.name); // last component only
+    ce->ce_namelen = (unsigned short)strlen(ce->ce_filename);
     ce->ce_size = fd.size;
     ce->ce_ino = 1; // requires GetFileInformationByHandle - uintmax_t
     ce->dwFileAttributes = fd.attrib; // FILE_ATTRIBUTE_NORMAL maps to 0
@@ -1295,6 +2963,14 @@ more_fflush(stdmore);
     //
     ce->ce_abspath = xstrdup(szFullPath);
 
+    if (bCache) {
+        //
+        // Put on the partial stat cache.  Keyed by the final abs path,
+        // so must come after any short-name rename above.
+        //
+        _add_stat_cache(ce);
+    }
+
     // Flag reparse points and .LNK shortcuts as symbolic links
     if ((ce->dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0 ||
             _mbsicmp(right(fd.name, 4), ".lnk") == 0) {
@@ -1302,9 +2978,10 @@ more_fflush(stdmore);
     }
 
     if (phys_size) {
-        ce->ce_size = _get_phys_size(szFullPath, ce->ce_size);
+        ce->ce_size = _get_phys_size(szFullPath, _find_volume(szFullPath),
+            ce->ce_size);
     }
-    if (!run_fast || bFixedDisk || print_inode) {
+    if (_want_full_info(bFixedDisk)) {
         //
         // Get inode and hardlink info
         //
@@ -1315,15 +2992,7 @@ cache_hit:
     if (bFollowSymlink) {
         ce = _follow_symlink(ce);
     }
-    memset(st, 0, sizeof(*st));
-    st->st_ino = ce->ce_ino;
-    st->st_size = ce->ce_size;
-    st->st_atime = ce->ce_atime;
-    st->st_mtime = ce->ce_mtime;
-    st->st_ctime = ce->ce_ctime;
-    st->st_nlink = (short)ce->nNumberOfLinks;
-    st->st_mode = _MapMode(ce);
-    st->st_ce = ce;
+    _fill_stat(ce, st);
 
     return 0;
 }
@@ -1355,12 +3024,12 @@ int _xreadlink(struct stat *pst, char *szBuf, int iBufLen)
 
     _follow_symlink(ce); // trigger reading the symlink if not already
 
-    if (ce->ce_symlink == NULL) {
+    if (CE_SYMLINK(ce) == NULL) {
         errno = EXDEV; // "Improper link"
         return -1;
     }
 
-    ce = ce->ce_symlink;
+    ce = CE_SYMLINK(ce);
 
     if (ce->ce_filename == NULL || ce->ce_filename[0] == '\0') {
         // cannot figure out symlink name..
@@ -1384,6 +3053,35 @@ int _xreadlink(struct stat *pst, char *szBuf, int iBufLen)
 
 //////////////////////////////////////////////////
 
+//
+// Read the target of a link into szPath.  Returns a pointer to the
+// target in szPath, or NULL if it cannot be read.
+//
+static char *
+_read_link(struct cache_entry *ce, char *szPath)
+{
+    char *sz;
+
+    if (gbReg) {
+        sz = _GetRegistryLink(ce, szPath);
+    } else if ((ce->dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0) {
+        //
+        // Query the reparse point
+        //
+        sz = _GetReparseTarget(ce, szPath);
+    } else {
+        //
+        // Query the .LNK shortcut
+        //
+        sz = _GetShortcutTarget(ce, szPath);
+    }
+
+    if (sz != NULL && !gbReg && short_names) {
+        _get_short_path(sz); // update in place
+    }
+    return sz;
+}
+
 //
 // Return the symlink if followable, otherwise return the current
 // node again
@@ -1391,11 +3089,11 @@ int _xreadlink(struct stat *pst, char *szBuf, int iBufLen)
 static struct cache_entry *
 _follow_symlink(struct cache_entry *ce)
 {
-    char *sz, *szFullPath;
+    char *sz;
     char szPath[FILENAME_MAX+10];
-    struct cache_entry *symce;
-    long hFind;
-    struct _finddatai64_t fd;
+    struct cache_entry *symce, *tce;
+    struct link_memo *lm;
+    struct xstat st;
     BOOL bFixedDisk = FALSE;
 
     if (!gbReg && !ce->ce_bIsSymlink) {
@@ -1403,47 +3101,45 @@ _follow_symlink(struct cache_entry *ce)
         return ce;
     }
 
-    if (ce->ce_symlink != NULL) {
-        return ce->ce_symlink; // return whatever we got earlier
+    if (CE_SYMLINK(ce) != NULL) {
+        return CE_SYMLINK(ce); // return whatever we got earlier
     }
 
-    if (ce->ce_bBadSymlink) {
+    if (ce->ce_cold != NULL && ce->ce_cold->cc_bBadSymlink) {
         //
         // Already tried and failed
         //
         return ce;
     }
 
-    ce->ce_bBadSymlink = TRUE; // provisionally mark as bad
+    _get_cold(ce)->cc_bBadSymlink = TRUE; // provisionally mark as bad
 
     if (ce->ce_abspath == NULL) { // if earlier _ExpandPath failed
         return ce; // bail
     }
 
-    if (gbReg) {
-        if ((sz = _GetRegistryLink(ce, szPath)) == NULL) {
-            return ce; // bail
-        }
-    } else if ((ce->dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0) {
-        //
-        // Query the reparse point
-        //
-        if ((sz = _GetReparseTarget(ce, szPath)) == NULL) {
-            return ce; // bail
+    //
+    // Read the link, unless another entry for the same path
+    // already did
+    //
+    lm = gbReg ? NULL : _lookup_link_memo(ce->ce_abspath);
+    if (lm != NULL) {
+        if (lm->lm_szTarget == NULL) {
+            return ce; // bad, as found earlier
         }
+        ++_stats.link_hits;
+        sz = strcpy(szPath, lm->lm_szTarget);
     } else {
-        //
-        // Query the .LNK shortcut
-        //
-        if ((sz = _GetShortcutTarget(ce, szPath)) == NULL) {
+        sz = _read_link(ce, szPath);
+        if (!gbReg) {
+            lm = _add_link_memo(ce->ce_abspath);
+            lm->lm_szTarget = (sz != NULL) ? xstrdup(sz) : NULL;
+        }
+        if (sz == NULL) {
             return ce; // bail
         }
     }
 
-    if (!gbReg && short_names) {
-        _get_short_path(sz); // update in place
-    }
-
     //
     // Build the symbolic link cache_entry
     //
@@ -1453,7 +3149,8 @@ _follow_symlink(struct cache_entry *ce)
     // Store relative path for later readlink() (not just last component)
     //
     symce->ce_filename = (char *)xstrdup(sz);
-    ce->ce_symlink = symce; // point to symlink
+    symce->ce_namelen = (unsigned short)strlen(sz);
+    ce->ce_cold->cc_symlink = symce; // point to symlink
     ce->ce_bIsSymlink = TRUE;
     symce->ce_ino = 1; // requires GetFileInformationByHandle - uintmax_t
     symce->dwFileAttributes |= FILE_ATTRIBUTE_DIRECTORY; // we know this..
@@ -1464,7 +3161,7 @@ _follow_symlink(struct cache_entry *ce)
     // we might lose st_mode, st_size and st_time info.
     //
 
-    ce->ce_bBadSymlink = FALSE; // link is ok
+    ce->ce_cold->cc_bBadSymlink = FALSE; // link is ok
 
 
     //
@@ -1484,74 +3181,34 @@ _follow_symlink(struct cache_entry *ce)
         return symce; // done
     }
 
-    szFullPath = szPath;
-
-#ifdef DEBUG_FINDFIRST
-more_printf("_follow_symlink: findfirst on \"%s\"\n", szFullPath);
-more_fflush(stdmore);
-#endif
-
     //
-    // Do a singleton FindFirst to get WIN32_FILE_DATA
+    // Look up the target like lstat() would, so that links sharing
+    // a target share one query via the dir, stat and negative caches.
+    // This also caches the target for the stat(linkpath) that ls.c
+    // does for coloring and indicators.
     //
-    if ((hFind = _xfindfirsti64(szFullPath, &fd,
-            FALSE/*bShowStreams*/, DT_UNKNOWN)) != (long)INVALID_HANDLE_VALUE) {
-        // Suceeded
-        if (_xfindclose(hFind, FALSE/*bShowStreams*/) == -1) {
-            MapWin32ErrorToPosixErrno();
-            return symce; // bail
-        }
-    } else {
-        //
-        // FindFirst failed.  This is a normal error (sic) for root folders
-        // e.g., C:\ and sometimes \\server\share\...
-        //
-        if ((szFullPath[1] == ':' && szFullPath[2] == '\\' && szFullPath[3] == '\0') ||
-                _IsServerRootPath(szFullPath)) {
-            //
-            // Fake an entry for the root folder
-            //
-            time_t t;
-            memset(&fd, 0, sizeof(fd));
-            t = time(0);
-            fd.attrib = FILE_ATTRIBUTE_DIRECTORY|FILE_ATTRIBUTE_SYSTEM;
-            strcpy(fd.name, "\\");
-            fd.time_access = t;
-            fd.time_write = t;
-            fd.time_create = t;
-        } else {
-            MapWin32ErrorToPosixErrno();
-            return symce;
-        }
+    if (__xstat(szPath, &st, DT_UNKNOWN, TRUE/*bCache*/,
+            FALSE/*bFollowSymlink*/) < 0 || (tce = st.st_ce) == NULL) {
+        return symce; // dangling
     }
 
     //
     // Fill in more data for the symlink target
     //
-    symce->ce_size = fd.size;
-    symce->dwFileAttributes = fd.attrib; // FILE_ATTRIBUTE_NORMAL maps to 0
-    symce->ce_atime = fd.time_access;
-    symce->ce_mtime = fd.time_write;
-    symce->ce_ctime = fd.time_create;
-
-    if (bFixedDisk) {
-        symce->dwFileAttributes |= FILE_ATTRIBUTE_FIXED_DISK;
-    }
-
-    // Flag reparse points and .LNK shortcuts as symbolic links
-    if ((symce->dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0 ||
-            _mbsicmp(right(fd.name, 4), ".lnk") == 0) {
-        symce->ce_bIsSymlink = TRUE; // symlink pointing to a symlink (rare)
-    }
-
-    if (phys_size) {
-        symce->ce_size = _get_phys_size(szFullPath, symce->ce_size);
-    }
+    symce->ce_size = tce->ce_size; // --phys-size already applied
+    symce->dwFileAttributes = tce->dwFileAttributes;
+    symce->ce_atime = tce->ce_atime;
+    symce->ce_mtime = tce->ce_mtime;
+    symce->ce_ctime = tce->ce_ctime;
+    symce->ce_ino = tce->ce_ino;
+    symce->nNumberOfLinks = tce->nNumberOfLinks;
+    symce->ce_bGotFullInfo = tce->ce_bGotFullInfo;
+    symce->ce_bIsSymlink = tce->ce_bIsSymlink; // symlink to a symlink (rare)
 
     //
     // Tah dah!
     //
-    ce->ce_bBadSymlink = FALSE;
+    ce->ce_cold->cc_bBadSymlink = FALSE;
 
     return symce;
 }
@@ -1565,7 +3222,6 @@ more_fflush(stdmore);
 static int
 _get_full_file_info(char *szFullPath, struct cache_entry *ce)
 {
-    HANDLE hFile;
     BY_HANDLE_FILE_INFORMATION bhfi;
 
     if (ce->ce_bGotFullInfo) {
@@ -1578,37 +3234,18 @@ _get_full_file_info(char *szFullPath, struct cache_entry *ce)
         return 0;
     }
 
-    //
-    // Open file with 0 access rights.
-    //
-    // FILE_FLAG_BACKUP_SEMANTICS is required to open directories
-    // (not supported on Win9x)
-    //
-    if ((hFile = CreateFile(szFullPath,
-            /*STANDARD_RIGHTS_READ | SYNCHRONIZE*/0,
-            0, 0, OPEN_EXISTING,
-            ((ce->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ?
-                FILE_FLAG_BACKUP_SEMANTICS : 0),
-            0)) == INVALID_HANDLE_VALUE)  {
+    memset(&bhfi, 0, sizeof(bhfi));
+
+    if (!FS_BACKEND()->fb_get_file_info(szFullPath, ce->dwFileAttributes,
+            &bhfi)) {
 #ifdef DEBUG_FINDFIRST
-more_printf("_get_full_file_info: CreateFile(%s) failed\n", szFullPath);
+more_printf("_get_full_file_info: get_file_info(%s) failed\n", szFullPath);
 more_fflush(stdmore);
 #endif
         MapWin32ErrorToPosixErrno();
         return -1;
     }
 
-    memset(&bhfi, 0, sizeof(bhfi));
-
-    if (!GetFileInformationByHandle(hFile, &bhfi)) {
-        MapWin32ErrorToPosixErrno();
-        CloseHandle(hFile);
-        return -1;
-    }
-
-    CloseHandle(hFile);
-
-    ce->dwVolumeSerialNumber = bhfi.dwVolumeSerialNumber;
     ce->nNumberOfLinks = bhfi.nNumberOfLinks;
     ce->ce_ino = _to_unsigned_int64(bhfi.nFileIndexLow, bhfi.nFileIndexHigh);
 
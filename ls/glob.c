@@ -55,8 +55,15 @@
 
 #if defined (HAVE_DIRENT_H)
 #  include <dirent.h>
-#  define D_NAMLEN(d) strlen ((d)->d_name)
+#  if WIN32
+#    define D_NAME(d) ((d)->d_pname) // see readdir_nocopy - AEK
+#    define D_NAMLEN(d) ((d)->d_namlen) // cached by dirent.c - AEK
+#  else
+#    define D_NAME(d) ((d)->d_name)
+#    define D_NAMLEN(d) strlen ((d)->d_name)
+#  endif
 #else /* !HAVE_DIRENT_H */
+#  define D_NAME(d) ((d)->d_name)
 #  define D_NAMLEN(d) ((d)->d_namlen)
 #  if defined (HAVE_SYS_NDIR_H)
 #    include <sys/ndir.h>
@@ -446,7 +453,11 @@ glob_vector (pat, dir)
         }
 #endif /* SHELL */
 
+#ifdef WIN32
+      dp = readdir_nocopy (d); // name in d_pname - AEK
+#else
       dp = readdir (d);
+#endif
       if (dp == NULL)
         break;
 
@@ -456,7 +467,7 @@ glob_vector (pat, dir)
 
       /* If a leading dot need not be explicitly matched, and the pattern
          doesn't start with a `.', don't match `.' or `..' */
-#define dname dp->d_name
+#define dname D_NAME (dp)
       if (noglob_dot_filenames == 0 && pat[0] != '.' &&
         (pat[0] != '\\' || pat[1] != '.') &&
         (dname[0] == '.' &&
@@ -465,11 +476,11 @@ glob_vector (pat, dir)
         continue;
 
       /* If a dot must be explicity matched, check to see if they do. */
-      if (noglob_dot_filenames && dp->d_name[0] == '.' && pat[0] != '.' &&
+      if (noglob_dot_filenames && D_NAME (dp)[0] == '.' && pat[0] != '.' &&
         (pat[0] != '\\' || pat[1] != '.'))
         continue;
 
-      if (fnmatch (pat, dp->d_name, flags) != FNM_NOMATCH)
+      if (fnmatch (pat, D_NAME (dp), flags) != FNM_NOMATCH)
         {
           nextlink = (struct globval *) alloca (sizeof (struct globval));
           nextlink->next = lastlink;
@@ -481,7 +492,7 @@ glob_vector (pat, dir)
         }
           lastlink = nextlink;
           nextlink->name = nextname;
-          bcopy (dp->d_name, nextname, D_NAMLEN (dp) + 1);
+          bcopy (D_NAME (dp), nextname, D_NAMLEN (dp) + 1);
           ++count;
         }
     }
@@ -136,6 +136,7 @@ int wcwidth ();
 #include "FindFiles.h" // AEK, for __time64_t
 #include "glob.h" // AEK
 #include "more.h" // AEK
+#include "Parallel.h" // for _ParallelFor
 
 extern void InitVersion(); // AEK
 
@@ -292,6 +293,15 @@ struct fileinfo
 
     enum filetype filetype;
 
+    /* With --top, the order in which the file was read.  */
+    unsigned long seq;
+
+    /* The name as quote_name prints it, or 0 if that is the name
+       itself, and its width in screen columns (-1 until measured by
+       file_name_width).  */
+    char *quoted_name;
+    int name_width;
+
 #if USE_ACL
     /* For long listings, nonzero if the file has an access control list,
        otherwise zero.  */
@@ -305,6 +315,23 @@ struct fileinfo
 # define FILE_HAS_ACL(F) 0
 #endif
 
+/* A file's sort key.  sort_files sorts an array of these rather than
+   the fileinfo structs themselves, so each swap moves a few words, and
+   the per-file work (finding the extension, picking the size or time)
+   is done once per file instead of once per comparison.  */
+
+struct sort_key
+  {
+    struct fileinfo *file;
+    const char *name;           /* file->name */
+    const char *ext;            /* Last `.' in name or 0, for -X only. */
+    uintmax_t num;              /* Size for -S, biased time for -t. */
+  };
+
+/* Map a signed time to an unsigned key with the same order.  */
+#define TIME_KEY(t) \
+  ((uintmax_t) (t) ^ ((uintmax_t) 1 << (sizeof (uintmax_t) * 8 - 1)))
+
 #define LEN_STR_PAIR(s) sizeof (s) - 1, s
 
 /* Null is a valid character in a color indicator (think about Epson
@@ -330,62 +357,76 @@ static size_t quote_name PARAMS ((MORE *out, const char *name,
                   struct quoting_options const *options));
 static char *make_link_path PARAMS ((const char *path, const char *linkname));
 static void mark_if_file_changed_recently PARAMS ((struct stat *pst)); // AEK
-static int compare_atime PARAMS ((const struct fileinfo *file1,
-                  const struct fileinfo *file2));
-static int rev_cmp_atime PARAMS ((const struct fileinfo *file2,
-                  const struct fileinfo *file1));
-static int compare_ctime PARAMS ((const struct fileinfo *file1,
-                  const struct fileinfo *file2));
-static int rev_cmp_ctime PARAMS ((const struct fileinfo *file2,
-                  const struct fileinfo *file1));
-static int compare_mtime PARAMS ((const struct fileinfo *file1,
-                  const struct fileinfo *file2));
-static int rev_cmp_mtime PARAMS ((const struct fileinfo *file2,
-                  const struct fileinfo *file1));
-static int compare_size PARAMS ((const struct fileinfo *file1,
-                 const struct fileinfo *file2));
-static int rev_cmp_size PARAMS ((const struct fileinfo *file2,
-                 const struct fileinfo *file1));
-static int compare_name PARAMS ((const struct fileinfo *file1,
-                 const struct fileinfo *file2));
-static int rev_cmp_name PARAMS ((const struct fileinfo *file2,
-                 const struct fileinfo *file1));
-static int compare_extension PARAMS ((const struct fileinfo *file1,
-                      const struct fileinfo *file2));
-static int rev_cmp_extension PARAMS ((const struct fileinfo *file2,
-                      const struct fileinfo *file1));
-static int compare_version PARAMS ((const struct fileinfo *file1,
-                    const struct fileinfo *file2));
-static int rev_cmp_version PARAMS ((const struct fileinfo *file2,
-                    const struct fileinfo *file1));
+static int compare_atime PARAMS ((const struct sort_key *key1,
+                  const struct sort_key *key2));
+static int rev_cmp_atime PARAMS ((const struct sort_key *key2,
+                  const struct sort_key *key1));
+static int compare_ctime PARAMS ((const struct sort_key *key1,
+                  const struct sort_key *key2));
+static int rev_cmp_ctime PARAMS ((const struct sort_key *key2,
+                  const struct sort_key *key1));
+static int compare_mtime PARAMS ((const struct sort_key *key1,
+                  const struct sort_key *key2));
+static int rev_cmp_mtime PARAMS ((const struct sort_key *key2,
+                  const struct sort_key *key1));
+static int compare_size PARAMS ((const struct sort_key *key1,
+                 const struct sort_key *key2));
+static int rev_cmp_size PARAMS ((const struct sort_key *key2,
+                 const struct sort_key *key1));
+static int compare_name PARAMS ((const struct sort_key *key1,
+                 const struct sort_key *key2));
+static int rev_cmp_name PARAMS ((const struct sort_key *key2,
+                 const struct sort_key *key1));
+static int compare_extension PARAMS ((const struct sort_key *key1,
+                      const struct sort_key *key2));
+static int rev_cmp_extension PARAMS ((const struct sort_key *key2,
+                      const struct sort_key *key1));
+static int compare_version PARAMS ((const struct sort_key *key1,
+                    const struct sort_key *key2));
+static int rev_cmp_version PARAMS ((const struct sort_key *key2,
+                    const struct sort_key *key1));
 // AEK
-static int compare_case_sensitive PARAMS ((const struct fileinfo *file1,
-                 const struct fileinfo *file2));
-static int rev_cmp_case_sensitive PARAMS ((const struct fileinfo *file2,
-                 const struct fileinfo *file1));
+static int compare_case_sensitive PARAMS ((const struct sort_key *key1,
+                 const struct sort_key *key2));
+static int rev_cmp_case_sensitive PARAMS ((const struct sort_key *key2,
+                 const struct sort_key *key1));
 static int decode_switches PARAMS ((int argc, char **argv));
+static void plan_queries PARAMS ((void));
 static int file_interesting PARAMS ((const struct dirent *next));
 static uintmax_t gobble_file PARAMS ((const char *name, enum filetype type,
-                      int explicit_arg, const char *dirname));
+                      int explicit_arg, const char *dirname,
+                      const struct dirent *ent));
 static void print_color_indicator PARAMS ((const char *name, unsigned int mode,
                        int linkok));
 static void put_indicator PARAMS ((const struct bin_str *ind));
 static int length_of_file_name_and_frills PARAMS ((const struct fileinfo *f));
 static void add_ignore_pattern PARAMS ((const char *pattern));
+static void compile_ignore_patterns PARAMS ((void));
+#ifdef WIN32
+static void print_ignore_stats PARAMS ((void));
+static void print_sort_stats PARAMS ((void));
+#endif
 static void attach PARAMS ((char *dest, const char *dirname, const char *name));
 static void clear_files PARAMS ((void));
+static void free_file PARAMS ((struct fileinfo *f));
 static void extract_dirs_from_files PARAMS ((const char *dirname,
                          int recursive));
 static void get_link_name PARAMS ((const char *filename, struct fileinfo *f));
 static void indent PARAMS ((int from, int to));
 static void init_column_info PARAMS ((void));
+static int choose_columns PARAMS ((int by_columns));
 static void print_current_files PARAMS ((void));
 static void print_dir PARAMS ((const char *name, const char *realname));
+static void print_dir_header PARAMS ((const char *name,
+                      const char *realname));
 static void print_file_name_and_frills PARAMS ((const struct fileinfo *f));
 static void print_horizontal PARAMS ((void));
 static void print_long_format PARAMS ((const struct fileinfo *f));
 static void print_many_per_line PARAMS ((void));
-static void print_name_with_quoting PARAMS ((const char *p, unsigned int mode,
+static int file_name_width PARAMS ((const struct fileinfo *f));
+static void print_name_with_quoting PARAMS ((const char *p,
+                         const struct fileinfo *f,
+                         unsigned int mode,
                          int linkok,
                          struct obstack *stack));
 static void prep_non_filename_text PARAMS ((void));
@@ -395,6 +436,8 @@ static void print_type_indicator PARAMS ((struct stat *pst,
 static void print_with_commas PARAMS ((void));
 static void queue_directory PARAMS ((const char *name, const char *realname));
 static void sort_files PARAMS ((void));
+static void top_add_file PARAMS ((unsigned long seq));
+static void top_sort_files PARAMS ((void));
 static void parse_ls_color PARAMS ((void));
 void usage PARAMS ((int status));
 
@@ -497,6 +540,26 @@ int phys_size; // --phys_size
 
 int short_names; // --short-names
 
+unsigned long stat_cache_max; // --stat-cache=N, 0=unlimited
+
+unsigned long cache_mem_max; // --cache-mem=SIZE, 0=unlimited
+
+int streaming; // --streaming
+
+unsigned long fetch_threads = 1; // --threads=N
+
+static unsigned long sort_threads; // --sort-threads=N, 0=one per CPU
+
+unsigned long dir_jobs = 1; // --jobs=N
+
+unsigned long prefetch_depth; // --prefetch=N, 0=off
+
+unsigned long top_n; // --top=N, 0=all
+
+unsigned int query_plan = ~0U; // see plan_queries()
+
+static int print_stats; // --stats
+
 int color_compressed; // --compressed
 
 static int command_line; // LS_OPTIONS vs command line arg
@@ -758,6 +821,55 @@ struct ignore_pattern
 
 static struct ignore_pattern *ignore_patterns;
 
+/* The ignore patterns compiled by compile_ignore_patterns, so that
+   file_interesting tests each name against all of them at once
+   instead of calling fnmatch once per pattern.  Patterns without
+   wildcards go in a hash table of exact names; `*SUFFIX' patterns
+   go in lists keyed by the suffix's last byte; the rest become one
+   bit-parallel automaton.  */
+
+struct ignore_name
+  {
+    struct ignore_name *next;
+    const char *name;
+    size_t len;
+  };
+
+struct ignore_matcher
+  {
+    struct ignore_name **exact;     /* Hash table of exact names. */
+    unsigned int exact_mask;        /* # slots - 1 */
+    struct ignore_name *suffix[256]; /* By the suffix's last byte. */
+    int match_undotted;             /* A `*' pattern: all but dot files. */
+
+    /* The automaton has one state bit per pattern element (a byte,
+       `?' or `[...]'); bit I set after N bytes of a name means some
+       pattern's elements up to I match those N bytes.  A `*' is a
+       self-loop on the state before it.  */
+    int nwords;                     /* uintmax_t words per state vector */
+    uintmax_t *char_mask;           /* [256][nwords]: elements matching C */
+    uintmax_t *first;               /* First elements of the patterns. */
+    uintmax_t *first_star;          /* ... of those that start with `*' */
+    uintmax_t *first_dot;           /* ... that are a literal `.' */
+    uintmax_t *loop;                /* Elements followed by `*'. */
+    uintmax_t *final;               /* Last elements. */
+    uintmax_t *state;               /* Scratch: 2 state vectors. */
+
+    unsigned int n_exact, n_suffix, n_states;
+  };
+
+static struct ignore_matcher ignore_matcher;
+
+#ifdef WIN32
+/* For --stats: the cost of filtering names through the matcher.  */
+static unsigned long ignore_tested, ignore_matched;
+static __int64 ignore_ticks;
+
+/* For --stats: the cost of sort_files, key setup and copy included.  */
+static unsigned long sort_calls, sort_count, sort_radix, sort_parallel;
+static __int64 sort_ticks;
+#endif
+
 /* Nonzero means output nongraphic chars in file names as `?'.
    (-q, --hide-control-chars)
    qmark_funny_chars and the quoting style (-Q, --quoting-style=WORD) are
@@ -834,6 +946,15 @@ enum
   RECENT_OPTION, // AEK
   PHYS_SIZE_OPTION, // AEK
   SHORT_NAMES_OPTION, // AEK
+  STAT_CACHE_OPTION,
+  STATS_OPTION,
+  CACHE_MEM_OPTION,
+  STREAMING_OPTION,
+  THREADS_OPTION,
+  SORT_THREADS_OPTION,
+  JOBS_OPTION,
+  PREFETCH_OPTION,
+  TOP_OPTION,
   COMPRESSED_OPTION, // AEK
   SHOW_STREAMS_OPTION, // AEK
   SIDS_OPTION, // AEK
@@ -901,6 +1022,7 @@ static struct option const long_options[] =
   {"color", optional_argument, 0, COLOR_OPTION},
   {"block-size", required_argument, 0, BLOCK_SIZE_OPTION},
   {"time-style", required_argument, 0, TIME_STYLE_OPTION},
+  {"top", required_argument, 0, TOP_OPTION},
 #ifdef WIN32
   {"fast", no_argument, 0, FAST_OPTION}, // AEK
   {"slow", no_argument, 0, SLOW_OPTION}, // AEK
@@ -908,6 +1030,14 @@ static struct option const long_options[] =
   {"more", no_argument, 0, 'M'}, // AEK
   {"phys-size", no_argument, 0, PHYS_SIZE_OPTION}, // AEK
   {"short-names", no_argument, 0, SHORT_NAMES_OPTION}, // AEK
+  {"stat-cache", required_argument, 0, STAT_CACHE_OPTION},
+  {"stats", no_argument, 0, STATS_OPTION},
+  {"cache-mem", required_argument, 0, CACHE_MEM_OPTION},
+  {"streaming", no_argument, 0, STREAMING_OPTION},
+  {"threads", required_argument, 0, THREADS_OPTION},
+  {"sort-threads", required_argument, 0, SORT_THREADS_OPTION},
+  {"jobs", required_argument, 0, JOBS_OPTION},
+  {"prefetch", required_argument, 0, PREFETCH_OPTION},
   {"compressed", no_argument, 0, COMPRESSED_OPTION}, // AEK
   {"streams", optional_argument, 0, SHOW_STREAMS_OPTION}, // AEK
   {"sids", optional_argument, 0, SIDS_OPTION}, // AEK
@@ -1054,16 +1184,15 @@ static int view_security; // AEK
 static int show_token; // AEK
 int virtual_view; // AEK
 
-/* Information about filling a column.  */
-struct column_info
-{
-  int valid_len;
-  int line_len;
-  int *col_arr;
-};
+/* Widths of the columns in the layout chosen by choose_columns,
+   each including the separating white space.  */
+static int *column_widths;
 
-/* Array with information about column filledness.  */
-static struct column_info *column_info;
+/* Width of each file name + frills, measured once by
+   init_column_info, and their sum.  */
+static int *name_widths;
+static int n_name_widths;
+static uintmax_t total_name_width;
 
 /* Maximum number of columns ever possible for this display.  */
 static int max_idx;
@@ -1412,6 +1541,8 @@ main (int argc, char **argv)
 
   i = decode_switches (argc, argv);
 
+  compile_ignore_patterns ();
+
   if (print_with_color)
     {
       parse_ls_color ();
@@ -1429,6 +1560,21 @@ main (int argc, char **argv)
   format_needs_type = (format_needs_stat == 0
                && (print_with_color || indicator_style != none));
 
+  plan_queries (); // AEK
+
+#ifdef WIN32
+  if (sort_threads == 0)
+    {
+      SYSTEM_INFO si;
+
+      GetSystemInfo (&si);
+      sort_threads = MIN (MAX (si.dwNumberOfProcessors, 1UL), 64UL);
+    }
+#else
+  if (sort_threads == 0)
+    sort_threads = 1;
+#endif
+
 #ifdef WIN32
   if (virtual_view) {
     VirtualView();
@@ -1454,7 +1600,7 @@ main (int argc, char **argv)
   for (; i < argc; i++)
     {
 #ifndef WIN32
-      gobble_file (argv[i], unknown, 1, "");
+      gobble_file (argv[i], unknown, 1, "", NULL);
 #else
       // begin AEK
       //
@@ -1546,7 +1692,7 @@ main (int argc, char **argv)
     continue;
       }
       for (j=0; glob_argv[j] != NULL; ++j) {
-        gobble_file(glob_argv[j], unknown, 1, "");
+        gobble_file(glob_argv[j], unknown, 1, "", NULL);
         free(glob_argv[j]);
       }
       free(glob_argv);
@@ -1569,7 +1715,7 @@ main (int argc, char **argv)
       }
 #endif
       if (immediate_dirs)
-    gobble_file (".", directory, 1, "");
+    gobble_file (".", directory, 1, "", NULL);
       else
     queue_directory (".", 0);
     }
@@ -1637,6 +1783,15 @@ main (int argc, char **argv)
               quoting_style_args, quoting_style_vals));
     }
 
+#ifdef WIN32
+  if (print_stats)
+    {
+      print_cache_stats ();
+      print_ignore_stats ();
+      print_sort_stats ();
+    }
+#endif
+
   exit (exit_status);
 }
 
@@ -2122,6 +2277,61 @@ Use `--si' for the old meaning."));
       short_names = 1;
       break;
 
+    case STAT_CACHE_OPTION:
+      if (xstrtoul (optarg, NULL, 0, &stat_cache_max, NULL) != LONGINT_OK)
+        error (EXIT_FAILURE, 0, _("invalid --stat-cache size: %s"),
+           quotearg (optarg));
+      break;
+
+    case STATS_OPTION:
+      print_stats = 1;
+      break;
+
+    case CACHE_MEM_OPTION:
+      if (xstrtoul (optarg, NULL, 0, &cache_mem_max, "kMG") != LONGINT_OK)
+        error (EXIT_FAILURE, 0, _("invalid --cache-mem size: %s"),
+           quotearg (optarg));
+      break;
+
+    case STREAMING_OPTION:
+      streaming = 1;
+      break;
+
+    case THREADS_OPTION:
+      if (xstrtoul (optarg, NULL, 0, &fetch_threads, NULL) != LONGINT_OK
+          || fetch_threads < 1 || fetch_threads > 64)
+        error (EXIT_FAILURE, 0, _("invalid --threads count: %s"),
+           quotearg (optarg));
+      break;
+
+    case SORT_THREADS_OPTION:
+      if (xstrtoul (optarg, NULL, 0, &sort_threads, NULL) != LONGINT_OK
+          || sort_threads < 1 || sort_threads > 64)
+        error (EXIT_FAILURE, 0, _("invalid --sort-threads count: %s"),
+           quotearg (optarg));
+      break;
+
+    case JOBS_OPTION:
+      if (xstrtoul (optarg, NULL, 0, &dir_jobs, NULL) != LONGINT_OK
+          || dir_jobs < 1 || dir_jobs > 64)
+        error (EXIT_FAILURE, 0, _("invalid --jobs count: %s"),
+           quotearg (optarg));
+      break;
+
+    case PREFETCH_OPTION:
+      if (xstrtoul (optarg, NULL, 0, &prefetch_depth, NULL) != LONGINT_OK
+          || prefetch_depth > 64)
+        error (EXIT_FAILURE, 0, _("invalid --prefetch depth: %s"),
+           quotearg (optarg));
+      break;
+
+    case TOP_OPTION:
+      if (xstrtoul (optarg, NULL, 0, &top_n, NULL) != LONGINT_OK
+          || top_n < 1 || top_n > INT_MAX)
+        error (EXIT_FAILURE, 0, _("invalid --top count: %s"),
+           quotearg (optarg));
+      break;
+
     case COMPRESSED_OPTION: // AEK
       color_compressed = 1;
       break;
@@ -2382,6 +2592,25 @@ Use `--si' for the old meaning."));
   return optind;
 }
 
+/* Work out which per-file queries the chosen columns, colors, sort
+   key and indicators need, so that dirent.c can skip the expensive
+   ones (e.g., no inode/link lookups for ls -C on a fixed disk).
+   Call after decode_switches and the format_needs_* setup.  - AEK */
+
+static void
+plan_queries (void)
+{
+  query_plan = 0;
+  if (format == long_format || print_inode)
+    query_plan |= QUERY_FULL_INFO; /* link count, -i */
+#ifdef WIN32
+  if (format == long_format || view_security)
+    query_plan |= QUERY_SECURITY; /* mode string, owner, ACLs */
+  if (show_streams == yes_arg)
+    query_plan |= QUERY_STREAMS;
+#endif
+}
+
 /* Parse a string as part of the LS_COLORS variable; this may involve
    decoding all kinds of escape characters.  If equals_end is set an
    unescaped equal sign ends the string, otherwise only a : or \0
@@ -2735,6 +2964,9 @@ queue_directory (const char *name, const char *realname)
     new->realname = xstrdup (realname);
   else
     new->realname = 0;
+#ifdef WIN32
+  prefetch_dir (name); // read it ahead with --jobs=N - AEK
+#endif
 }
 
 /* Read directory `name', and list the files in it.
@@ -2747,6 +2979,12 @@ print_dir (const char *name, const char *realname)
   register DIR *reading;
   register struct dirent *next;
   register uintmax_t total_blocks = 0;
+  unsigned long n_read = 0;
+  int n_files;
+  int stream_output;
+#ifdef WIN32
+  DWORD dwLastFlush = 0;
+#endif
 
   errno = 0;
 #ifdef WIN32
@@ -2761,12 +2999,25 @@ print_dir (const char *name, const char *realname)
       return;
     }
 
+  // With --streaming, print unsorted one-per-line entries as they are
+  // read instead of after the whole dir - AEK
+  stream_output = (streaming && sort_type == sort_none
+           && format == one_per_line && !print_block_size
+           && !trace_dirs && !top_n);
+
   /* Read the directory entries, and insert the subfiles into the `files'
      table.  */
 
   clear_files ();
 
+  if (stream_output)
+    print_dir_header (name, realname);
+
+#ifdef WIN32
+  while ((next = readdir_nocopy (reading)) != NULL) // AEK no name copy
+#else
   while ((next = readdir (reading)) != NULL)
+#endif
     if (file_interesting (next))
       {
     enum filetype type = unknown;
@@ -2777,7 +3028,24 @@ print_dir (const char *name, const char *realname)
         || next->d_type == DT_FIFO)
       type = next->d_type;
 #endif
-    total_blocks += gobble_file (next->d_name, type, 0, name);
+    n_files = files_index;
+    total_blocks += gobble_file (next->d_pname, type, 0, name, next);
+
+    /* Keep only the best N so far.  The total still counts them all.  */
+    if (top_n && files_index > n_files)
+      top_add_file (n_read++);
+
+    if (stream_output) {
+      print_current_files ();
+      clear_files ();
+#ifdef WIN32
+      // Push out what we have at least every 100ms, not per entry
+      if (GetTickCount () - dwLastFlush >= 100) {
+        more_fflush (stdmore);
+        dwLastFlush = GetTickCount ();
+      }
+#endif
+    }
       }
 
   if (CLOSEDIR (reading))
@@ -2787,8 +3055,18 @@ print_dir (const char *name, const char *realname)
       /* Don't return; print whatever we got. */
     }
 
+  if (stream_output)
+    {
+      if (pending_dirs)
+    DIRED_PUTCHAR ('\n');
+      return;
+    }
+
   /* Sort the directory contents.  */
-  sort_files ();
+  if (top_n)
+    top_sort_files ();
+  else
+    sort_files ();
 
   /* If any member files are subdirectories, perhaps they should have their
      contents listed rather than being mentioned here as files.  */
@@ -2796,15 +3074,7 @@ print_dir (const char *name, const char *realname)
   if (trace_dirs)
     extract_dirs_from_files (name, 1);
 
-  if (trace_dirs || print_dir_name)
-    {
-      DIRED_INDENT ();
-      PUSH_CURRENT_DIRED_POS (&subdired_obstack);
-      dired_pos += quote_name (stdmore, realname ? realname : name,
-                   dirname_quoting_options);
-      PUSH_CURRENT_DIRED_POS (&subdired_obstack);
-      DIRED_FPUTS_LITERAL (":\n", stdmore);
-    }
+  print_dir_header (name, realname);
 
   if (format == long_format || print_block_size)
     {
@@ -2828,6 +3098,22 @@ print_dir (const char *name, const char *realname)
     DIRED_PUTCHAR ('\n');
 }
 
+/* Print the `name:' line that precedes a directory's listing, if any.  */
+
+static void
+print_dir_header (const char *name, const char *realname)
+{
+  if (trace_dirs || print_dir_name)
+    {
+      DIRED_INDENT ();
+      PUSH_CURRENT_DIRED_POS (&subdired_obstack);
+      dired_pos += quote_name (stdmore, realname ? realname : name,
+                   dirname_quoting_options);
+      PUSH_CURRENT_DIRED_POS (&subdired_obstack);
+      DIRED_FPUTS_LITERAL (":\n", stdmore);
+    }
+}
+
 /* Add `pattern' to the list of patterns for which files that match are
    not listed.  */
 
@@ -2843,109 +3129,582 @@ add_ignore_pattern (const char *pattern)
   ignore_patterns = ignore;
 }
 
-/* Return nonzero if the file in `next' should be listed. */
+/* Kinds of pattern element, as returned by parse_ignore_element.  */
+#define IGN_END   0     /* End of the pattern. */
+#define IGN_BYTE  1     /* A literal byte. */
+#define IGN_SET   2     /* `?' or `[...]'. */
+#define IGN_STAR  3     /* `*' */
+#define IGN_NEVER 4     /* A bad `[' or `\': the pattern never matches. */
+#define IGN_HARD  5     /* A `\' inside `[...]': leave it to fnmatch. */
+
+/* Bits in each word of an automaton state vector.  */
+#define IGN_WORD_BITS (sizeof (uintmax_t) * CHAR_BIT)
+
+/* Parse the element of an ignore pattern at *PP the way fnmatch does
+   with FNM_PERIOD, and advance *PP past it.  For IGN_BYTE, put the
+   byte in *PBYTE.  For IGN_BYTE and IGN_SET, set SET[B] nonzero for
+   each byte B that the element matches.  */
 
 static int
-file_interesting (const struct dirent *next)
+parse_ignore_element (const char **pp, char *set, char *pbyte)
 {
-  register struct ignore_pattern *ignore;
-
-  for (ignore = ignore_patterns; ignore; ignore = ignore->next)
-    if (fnmatch (ignore->pattern, next->d_name, FNM_PERIOD) == 0)
-      return 0;
+  const char *p = *pp;
+  char c = *p++;
+  int not, b;
 
-  if (next->d_name[0] == '.' && next->d_name[1] == '\0') return really_all_files;
-  if (next->d_name[0] == '.' && next->d_name[1] == '.' && next->d_name[2] == '\0') return really_all_files;
+  switch (c)
+    {
+    case '\0':
+      return IGN_END;
+
+    case '*':
+      *pp = p;
+      return IGN_STAR;
+
+    case '?':
+      memset (set, 1, 256);
+      *pp = p;
+      return IGN_SET;
+
+    case '[':
+      memset (set, 0, 256);
+      not = (*p == '!' || *p == '^');
+      if (not)
+    ++p;
+      c = *p++;
+      for (;;)
+    {
+      char cstart = c, cend = c;
+
+      if (c == '\\')
+        return IGN_HARD;
+      if (c == '\0')
+        return IGN_NEVER;
+      c = *p++;
+      if (c == '-' && *p != ']')
+        {
+          cend = *p++;
+          if (cend == '\\')
+        return IGN_HARD;
+          if (cend == '\0')
+        return IGN_NEVER;
+          c = *p++;
+        }
+      /* fnmatch compares plain chars, so keep their signedness.  */
+      for (b = 0; b < 256; b++)
+        if ((char) b >= cstart && (char) b <= cend)
+          set[b] = 1;
+      if (c == ']')
+        break;
+    }
+      if (not)
+    for (b = 0; b < 256; b++)
+      set[b] = !set[b];
+      *pp = p;
+      return IGN_SET;
 
-  if (all_files) return 1;
+    case '\\':
+      c = *p++;
+      if (c == '\0')
+    return IGN_NEVER;
+      /* Fall through.  */
+    default:
+      memset (set, 0, 256);
+      set[(unsigned char) c] = 1;
+      *pbyte = c;
+      *pp = p;
+      return IGN_BYTE;
+    }
+}
 
-  if (next->d_name[0] == '.') return 0;
-  if (next->d_name[0] == '_') return 0;
+/* How compile_ignore_patterns handles a pattern.  */
+enum ignore_class
   {
-    unsigned long attribs = next->d_ce->dwFileAttributes;
-    if (attribs & FILE_ATTRIBUTE_HIDDEN) return 0;
-  }
+    ignore_never, ignore_fnmatch, ignore_exact, ignore_suffix,
+    ignore_automaton
+  };
 
-  return 1;
+/* Classify PATTERN.  Put the number of bytes its literal part takes
+   in *PLEN, and the number of automaton states it needs in *PSTATES.  */
+
+static enum ignore_class
+classify_ignore_pattern (const char *pattern, size_t *plen, int *pstates)
+{
+  char set[256];
+  char byte;
+  int kind;
+  int stars = 0, sets = 0, leading_star = 0;
+
+  *plen = 0;
+  *pstates = 0;
+  while ((kind = parse_ignore_element (&pattern, set, &byte)) != IGN_END)
+    switch (kind)
+      {
+      case IGN_NEVER:
+    return ignore_never;
+      case IGN_HARD:
+    return ignore_fnmatch;
+      case IGN_STAR:
+    if (*plen == 0 && sets == 0)
+      leading_star = 1;
+    else
+      stars++;
+    break;
+      case IGN_SET:
+    sets++;
+    ++*pstates;
+    break;
+      default:
+    ++*plen;
+    ++*pstates;
+    break;
+      }
+
+  if (sets == 0 && stars == 0)
+    return leading_star ? ignore_suffix : ignore_exact;
+  return ignore_automaton;
 }
 
-/* Enter and remove entries in the table `files'.  */
+/* Hash the LEN bytes at NAME.  */
 
-/* Empty the table of files. */
+static unsigned int
+hash_ignore_name (const char *name, size_t len)
+{
+  unsigned int h = 0;
 
-static void
-clear_files (void)
+  while (len--)
+    h = h * 31 + (unsigned char) *name++;
+  return h;
+}
+
+/* Make an ignore_name of the literal bytes of PATTERN, which has LEN
+   of them.  */
+
+static struct ignore_name *
+make_ignore_name (const char *pattern, size_t len)
 {
-  register int i;
+  struct ignore_name *in;
+  char set[256];
+  char *q;
+  int kind;
+
+  in = (struct ignore_name *) xmalloc (sizeof (*in));
+  q = (char *) xmalloc (len + 1);
+  in->name = q;
+  in->len = len;
+  while ((kind = parse_ignore_element (&pattern, set, q)) != IGN_END)
+    if (kind == IGN_BYTE)
+      q++;
+  *q = '\0';
+  return in;
+}
 
-  for (i = 0; i < files_index; i++)
+/* Add the elements of PATTERN to the automaton as states STATE on.
+   Return the next free state.  */
+
+static int
+add_ignore_automaton (const char *pattern, int state)
+{
+  struct ignore_matcher *m = &ignore_matcher;
+  int nw = m->nwords;
+  int first = state, leading_star = 0;
+  char set[256];
+  char byte;
+  int kind, b;
+
+  while ((kind = parse_ignore_element (&pattern, set, &byte)) != IGN_END)
     {
-      free (files[i].name);
-      if (files[i].linkname)
-    free (files[i].linkname);
-    }
+      int w = state / IGN_WORD_BITS;
+      uintmax_t bit = (uintmax_t) 1 << (state % IGN_WORD_BITS);
 
-  files_index = 0;
-  block_size_size = 4;
-  long_block_size_size = 4; // AEK
+      if (kind == IGN_STAR)
+    {
+      if (state == first)
+        leading_star = 1;
+      else
+        {
+          w = (state - 1) / IGN_WORD_BITS;
+          m->loop[w] |= (uintmax_t) 1 << ((state - 1) % IGN_WORD_BITS);
+        }
+      continue;
+    }
+      if (state == first)
+    {
+      m->first[w] |= bit;
+      if (leading_star)
+        m->first_star[w] |= bit;
+      else if (kind == IGN_BYTE && byte == '.')
+        m->first_dot[w] |= bit;
+    }
+      for (b = 0; b < 256; b++)
+    if (set[b])
+      m->char_mask[b * nw + w] |= bit;
+      state++;
+    }
+  m->final[(state - 1) / IGN_WORD_BITS]
+    |= (uintmax_t) 1 << ((state - 1) % IGN_WORD_BITS);
+  return state;
 }
 
-/* Add a file to the current table of files.
-   Verify that the file exists, and print an error message if it does not.
-   Return the number of blocks that the file occupies.  */
+/* Compile the -I and -B patterns into ignore_matcher.  Only the
+   patterns it cannot handle are left in ignore_patterns.  */
 
-static uintmax_t
-gobble_file (const char *name, enum filetype type, int explicit_arg,
-         const char *dirname)
+static void
+compile_ignore_patterns (void)
 {
-  register uintmax_t blocks;
-  register char *path;
+  struct ignore_matcher *m = &ignore_matcher;
+  struct ignore_pattern *ignore, **link;
+  struct ignore_name *in;
+  unsigned int h;
+  size_t len;
+  int states, state;
+
+  /* Count what each part needs.  */
+  for (ignore = ignore_patterns; ignore; ignore = ignore->next)
+    switch (classify_ignore_pattern (ignore->pattern, &len, &states))
+      {
+      case ignore_exact:
+    m->n_exact++;
+    break;
+      case ignore_suffix:
+    m->n_suffix++;
+    break;
+      case ignore_automaton:
+    m->n_states += states;
+    break;
+      default:
+    break;
+      }
 
-  if (files_index == nfiles)
+  if (m->n_exact)
     {
-      nfiles *= 2;
-      files = (struct fileinfo *) xrealloc ((char *) files,
-                        sizeof (*files) * nfiles);
+      for (h = 1; h < m->n_exact; h *= 2)
+    continue;
+      m->exact_mask = h - 1;
+      m->exact = (struct ignore_name **) xmalloc (h * sizeof (*m->exact));
+      memset (m->exact, 0, h * sizeof (*m->exact));
+    }
+  if (m->n_states)
+    {
+      size_t nw = (m->n_states + IGN_WORD_BITS - 1) / IGN_WORD_BITS;
+      size_t bytes = (256 + 6) * nw * sizeof (uintmax_t);
+
+      m->nwords = (int) nw;
+      m->char_mask = (uintmax_t *) xmalloc (bytes);
+      memset (m->char_mask, 0, bytes);
+      m->first = m->char_mask + 256 * nw;
+      m->first_star = m->first + nw;
+      m->first_dot = m->first_star + nw;
+      m->loop = m->first_dot + nw;
+      m->final = m->loop + nw;
+      m->state = m->final + nw;
+    }
+
+  /* Fill them in, keeping only the fnmatch patterns on the list.  */
+  state = 0;
+  link = &ignore_patterns;
+  while ((ignore = *link) != NULL)
+    {
+      switch (classify_ignore_pattern (ignore->pattern, &len, &states))
+    {
+    case ignore_fnmatch:
+      link = &ignore->next;
+      continue;
+    case ignore_exact:
+      in = make_ignore_name (ignore->pattern, len);
+      h = hash_ignore_name (in->name, len) & m->exact_mask;
+      in->next = m->exact[h];
+      m->exact[h] = in;
+      break;
+    case ignore_suffix:
+      if (len == 0)
+        {
+          m->match_undotted = 1;
+          break;
+        }
+      in = make_ignore_name (ignore->pattern, len);
+      h = (unsigned char) in->name[len - 1];
+      in->next = m->suffix[h];
+      m->suffix[h] = in;
+      break;
+    case ignore_automaton:
+      state = add_ignore_automaton (ignore->pattern, state);
+      break;
+    default:
+      break;
+    }
+      *link = ignore->next;
+      free (ignore);
     }
+}
 
-  files[files_index].linkname = 0;
-  files[files_index].linkmode = 0;
-  files[files_index].linkok = 0;
+/* Return nonzero if the compiled automaton matches NAME.  */
 
-  /* FIXME: this use of ls: `mkdir a; touch a/{b,c,d}; ls -R a'
-     shouldn't require that ls stat b, c, and d -- at least
-     not on systems with usable d_type.  The problem is that
-     format_needs_stat is set, because of the -R.  */
-  if (explicit_arg || format_needs_stat
-      || (format_needs_type && type == unknown))
-    {
-      /* `path' is the absolute pathname of this file. */
-      int val;
+static int
+ignore_automaton_matches (const char *name)
+{
+  struct ignore_matcher *m = &ignore_matcher;
+  const unsigned char *s = (const unsigned char *) name;
+  const uintmax_t *start, *inject, *cm;
+  uintmax_t *d = m->state;
+  uintmax_t live, carry, dw, next;
+  int nw = m->nwords;
+  int w;
+
+  if (*s == '\0')
+    return 0;
 
-      if (name[0] == '/' || dirname[0] == 0
-#ifdef WIN32
-    // C:xxx - dont concat
-    || (name[0] != '\0' && name[1] == ':')
-#endif
-    )
-    path = (char *) name;
-      else
+  /* A leading `.' is matched only by a literal `.' (FNM_PERIOD), so
+     it also rules out the patterns that start with `*'.  */
+  start = *s == '.' ? m->first_dot : m->first;
+  inject = *s == '.' ? NULL : m->first_star;
+  cm = m->char_mask + *s * nw;
+  live = 0;
+  for (w = 0; w < nw; w++)
+    live |= d[w] = start[w] & cm[w];
+
+  while (*++s)
     {
-      path = (char *) alloca (strlen (name) + strlen (dirname) + 2);
-      attach (path, dirname, name);
+      if (!live && !inject)
+    return 0;
+      cm = m->char_mask + *s * nw;
+      carry = 0;
+      live = 0;
+      for (w = 0; w < nw; w++)
+    {
+      dw = d[w];
+      next = ((dw << 1) | carry) & ~m->first[w];
+      carry = dw >> (IGN_WORD_BITS - 1);
+      if (inject)
+        next |= inject[w];
+      live |= d[w] = (next & cm[w]) | (dw & m->loop[w]);
+    }
     }
 
-#ifdef WIN32
-      val = (trace_links
-         ? stat_nocache (path, &files[files_index].stat, (unsigned long)type)
-         : lstat_nocache (path, &files[files_index].stat, (unsigned long)type));
-#else
-      val = (trace_links
-         ? stat (path, &files[files_index].stat)
-         : lstat (path, &files[files_index].stat));
-#endif
+  for (w = 0; w < nw; w++)
+    if (d[w] & m->final[w])
+      return 1;
+  return 0;
+}
 
-      mark_if_file_changed_recently(&files[files_index].stat); // AEK
+/* Return nonzero if NAME, which is LEN bytes long, matches one of the
+   -I or -B patterns.  */
+
+static int
+ignored_name (const char *name, size_t len)
+{
+  struct ignore_matcher *m = &ignore_matcher;
+  struct ignore_pattern *ignore;
+  struct ignore_name *in;
+
+  if (m->exact)
+    for (in = m->exact[hash_ignore_name (name, len) & m->exact_mask]; in;
+     in = in->next)
+      if (in->len == len && memcmp (in->name, name, len) == 0)
+    return 1;
+
+  /* `*SUFFIX' does not match a leading `.' (FNM_PERIOD).  */
+  if (name[0] != '.')
+    {
+      if (m->match_undotted)
+    return 1;
+      if (len > 0)
+    for (in = m->suffix[(unsigned char) name[len - 1]]; in; in = in->next)
+      if (in->len <= len
+          && memcmp (in->name, name + len - in->len, in->len) == 0)
+        return 1;
+    }
+
+  if (m->n_states && ignore_automaton_matches (name))
+    return 1;
+
+  for (ignore = ignore_patterns; ignore; ignore = ignore->next)
+    if (fnmatch (ignore->pattern, name, FNM_PERIOD) == 0)
+      return 1;
+
+  return 0;
+}
+
+#ifdef WIN32
+/* Print the ignore matcher's layout and cost (--stats).  */
+
+static void
+print_ignore_stats (void)
+{
+  struct ignore_matcher *m = &ignore_matcher;
+  struct ignore_pattern *ignore;
+  LARGE_INTEGER freq;
+  unsigned int n_fnmatch = 0;
+  double ns = 0;
+
+  for (ignore = ignore_patterns; ignore; ignore = ignore->next)
+    n_fnmatch++;
+  if (ignore_tested && QueryPerformanceFrequency (&freq) && freq.QuadPart)
+    ns = (double) ignore_ticks * 1e9 / (double) freq.QuadPart
+      / (double) ignore_tested;
+  more_fprintf (stdmore_err, "ignore patterns: %u exact, %u suffix, "
+        "%u automaton states, %u by fnmatch; %lu names tested, "
+        "%lu ignored, %.0f ns per name\n",
+        m->n_exact, m->n_suffix + m->match_undotted, m->n_states,
+        n_fnmatch, ignore_tested, ignore_matched, ns);
+  more_fflush (stdmore_err);
+}
+
+/* Print the time spent sorting (--stats).  */
+
+static void
+print_sort_stats (void)
+{
+  LARGE_INTEGER freq;
+  double ms = 0;
+
+  if (sort_calls && QueryPerformanceFrequency (&freq) && freq.QuadPart)
+    ms = (double) sort_ticks * 1e3 / (double) freq.QuadPart;
+  more_fprintf (stdmore_err, "sort: %lu files in %lu lists "
+        "(%lu radix, %lu parallel), %.0f ms\n",
+        sort_count, sort_calls, sort_radix, sort_parallel, ms);
+  more_fflush (stdmore_err);
+}
+#endif
+
+/* Return nonzero if the file in `next' should be listed. */
+
+static int
+file_interesting (const struct dirent *next)
+{
+  const char *name = next->d_pname; // AEK set by readdir and readdir_nocopy
+  int ignored;
+
+#ifdef WIN32
+  if (print_stats)
+    {
+      LARGE_INTEGER start, end;
+
+      QueryPerformanceCounter (&start);
+      ignored = ignored_name (name, next->d_namlen);
+      QueryPerformanceCounter (&end);
+      ignore_ticks += end.QuadPart - start.QuadPart;
+      ignore_tested++;
+      ignore_matched += ignored;
+    }
+  else
+#endif
+    ignored = ignored_name (name, next->d_namlen);
+  if (ignored)
+    return 0;
+
+  if (name[0] == '.' && name[1] == '\0') return really_all_files;
+  if (name[0] == '.' && name[1] == '.' && name[2] == '\0') return really_all_files;
+
+  if (all_files) return 1;
+
+  if (name[0] == '.') return 0;
+  if (name[0] == '_') return 0;
+  {
+    unsigned long attribs = next->d_ce->dwFileAttributes;
+    if (attribs & FILE_ATTRIBUTE_HIDDEN) return 0;
+  }
+
+  return 1;
+}
+
+/* Enter and remove entries in the table `files'.  */
+
+/* Empty the table of files. */
+
+static void
+clear_files (void)
+{
+  register int i;
+
+  for (i = 0; i < files_index; i++)
+    free_file (&files[i]);
+
+  files_index = 0;
+  block_size_size = 4;
+  long_block_size_size = 4; // AEK
+
+#ifdef WIN32
+  release_cache_entries (); // files[].stat.st_ce are gone
+#endif
+}
+
+/* Free the strings of file F.  */
+
+static void
+free_file (struct fileinfo *f)
+{
+  free (f->name);
+  if (f->linkname)
+    free (f->linkname);
+  if (f->quoted_name)
+    free (f->quoted_name);
+}
+
+/* Add a file to the current table of files.
+   Verify that the file exists, and print an error message if it does not.
+   Return the number of blocks that the file occupies.  */
+
+static uintmax_t
+gobble_file (const char *name, enum filetype type, int explicit_arg,
+         const char *dirname, const struct dirent *ent)
+{
+  register uintmax_t blocks;
+  register char *path;
+  size_t namelen = (ent != NULL ? ent->d_namlen : strlen (name)); // AEK
+
+  if (files_index == nfiles)
+    {
+      nfiles *= 2;
+      files = (struct fileinfo *) xrealloc ((char *) files,
+                        sizeof (*files) * nfiles);
+    }
+
+  files[files_index].linkname = 0;
+  files[files_index].quoted_name = 0;
+  files[files_index].name_width = -1;
+  files[files_index].linkmode = 0;
+  files[files_index].linkok = 0;
+
+  /* FIXME: this use of ls: `mkdir a; touch a/{b,c,d}; ls -R a'
+     shouldn't require that ls stat b, c, and d -- at least
+     not on systems with usable d_type.  The problem is that
+     format_needs_stat is set, because of the -R.  */
+  if (explicit_arg || format_needs_stat
+      || (format_needs_type && type == unknown))
+    {
+      /* `path' is the absolute pathname of this file. */
+      int val;
+
+      if (name[0] == '/' || dirname[0] == 0
+#ifdef WIN32
+    // C:xxx - dont concat
+    || (name[0] != '\0' && name[1] == ':')
+#endif
+    )
+    path = (char *) name;
+      else
+    {
+      path = (char *) alloca (namelen + strlen (dirname) + 2);
+      attach (path, dirname, name);
+    }
+
+#ifdef WIN32
+      if (ent != NULL && ent->d_ce != NULL) // AEK fast path: no path lookup
+    val = (trace_links
+           ? stat_dirent (ent, &files[files_index].stat)
+           : lstat_dirent (ent, &files[files_index].stat));
+      else
+    val = (trace_links
+           ? stat_nocache (path, &files[files_index].stat, (unsigned long)type)
+           : lstat_nocache (path, &files[files_index].stat, (unsigned long)type));
+#else
+      val = (trace_links
+         ? stat (path, &files[files_index].stat)
+         : lstat (path, &files[files_index].stat));
+#endif
+
+      mark_if_file_changed_recently(&files[files_index].stat); // AEK
 
       if (val < 0)
     {
@@ -3067,7 +3826,8 @@ gobble_file (const char *name, enum filetype type, int explicit_arg,
       blocks = 0;
     }
 
-  files[files_index].name = xstrdup (name);
+  files[files_index].name = (char *) xmalloc (namelen + 1);
+  memcpy (files[files_index].name, name, namelen + 1);
   files_index++;
 
   return blocks;
@@ -3219,18 +3979,231 @@ extract_dirs_from_files (const char *dirname, int recursive)
   files_index = j;
 }
 
-/* Sort the files now in the table.  */
+/* Fill in the sort key of file F.  */
 
 static void
-sort_files (void)
+make_sort_key (struct sort_key *key, struct fileinfo *f)
+{
+  key->file = f;
+  key->name = f->name;
+  key->ext = sort_type == sort_extension ? strrchr (f->name, '.') : 0;
+  key->num = 0;
+  if (sort_type == sort_size)
+    key->num = f->stat.st_size;
+  else if (sort_type == sort_time)
+    switch (time_type)
+      {
+      case time_ctime:
+    key->num = TIME_KEY (f->stat.st_ctime);
+    break;
+      case time_mtime:
+    key->num = TIME_KEY (f->stat.st_mtime);
+    break;
+      case time_atime:
+    key->num = TIME_KEY (f->stat.st_atime);
+    break;
+      }
+}
+
+/* Below this many files, qsort beats the setup cost of a radix sort.  */
+#define RADIX_SORT_MIN 256
+
+/* Sort the N keys in KEYS by their `num' field, least significant
+   byte first, using TMP (N more keys) as scratch space.  Stable.  If
+   DESCENDING, the largest comes first.  */
+
+static void
+radix_sort_keys (struct sort_key *keys, struct sort_key *tmp, int n,
+         int descending)
+{
+  static size_t count[sizeof (uintmax_t)][256];
+  uintmax_t flip = descending ? ~(uintmax_t) 0 : 0;
+  struct sort_key *src = keys, *dst = tmp, *t;
+  unsigned int d, b;
+  size_t sum, c;
+  int i;
+
+  /* Count all the digits in one pass.  */
+  memset (count, 0, sizeof count);
+  for (i = 0; i < n; i++)
+    {
+      uintmax_t v = keys[i].num ^ flip;
+      for (d = 0; d < sizeof (uintmax_t); d++)
+    count[d][(v >> (d * 8)) & 0xFF]++;
+    }
+
+  for (d = 0; d < sizeof (uintmax_t); d++)
+    {
+      /* Skip a digit that is the same in every key, e.g. the high
+         bytes of file sizes or of times from the same decade.  */
+      if (count[d][((src[0].num ^ flip) >> (d * 8)) & 0xFF] == (size_t) n)
+    continue;
+      for (sum = 0, b = 0; b < 256; b++)
+    {
+      c = count[d][b];
+      count[d][b] = sum;
+      sum += c;
+    }
+      for (i = 0; i < n; i++)
+    dst[count[d][((src[i].num ^ flip) >> (d * 8)) & 0xFF]++] = src[i];
+      t = src;
+      src = dst;
+      dst = t;
+    }
+  if (src != keys)
+    memcpy (keys, src, sizeof (*keys) * n);
+}
+
+/* With --sort-threads=N, sort at least this many files on N threads.  */
+#define PARALLEL_SORT_MIN 65536
+
+typedef int (*qsort_compare_t)( const void *, const void * );
+
+/* The comparator chosen by sort_files.  */
+static qsort_compare_t sort_func;
+
+/* Call sort_func, breaking ties by the files' places in the table.
+   This makes the order fully defined, so that qsort, the radix sort
+   and the parallel merge sort all give the same result.  */
+
+static int
+compare_stable (const void *p1, const void *p2)
+{
+  const struct sort_key *key1 = (const struct sort_key *) p1;
+  const struct sort_key *key2 = (const struct sort_key *) p2;
+  int diff = (*sort_func) (p1, p2);
+  if (diff == 0)
+    diff = longdiff (key1->file, key2->file);
+  return diff;
+}
+
+/* Work for parallel_sort_keys: runs of WIDTH keys in SRC, the last
+   one maybe shorter.  A merge of two runs is split into PIECES parts
+   of about equal output, so that the last merges, with fewer pairs
+   than threads, still use every thread.  */
+
+struct sort_pass
+  {
+    struct sort_key *src;
+    struct sort_key *dst;
+    int n;
+    int width;
+    int pieces;
+  };
+
+/* Sort run I of a pass with qsort.  Called on a pool thread.  */
+
+static void
+sort_run (void *ctx, int i)
+{
+  struct sort_pass *pass = (struct sort_pass *) ctx;
+  int lo = i * pass->width;
+  int hi = MIN (lo + pass->width, pass->n);
+
+  qsort ( (void *)(pass->src + lo), (size_t)(hi - lo),
+     (size_t)sizeof (struct sort_key), compare_stable);
+}
+
+/* Return how many of the first K keys of the merge of sorted runs A
+   (M keys) and B (N keys) come from A.  compare_stable never returns
+   0 for two different keys, so the split is unique.  */
+
+static int
+merge_split (const struct sort_key *a, int m, const struct sort_key *b, int n,
+             int k)
+{
+  int lo = MAX (0, k - n);
+  int hi = MIN (k, m);
+
+  while (lo < hi)
+    {
+      int i = lo + (hi - lo) / 2;
+      if (compare_stable (&a[i], &b[k - i - 1]) < 0)
+        lo = i + 1;
+      else
+        hi = i;
+    }
+  return lo;
+}
+
+/* Merge piece I % PIECES of runs 2*(I / PIECES) and 2*(I / PIECES)+1
+   of a pass from SRC into DST.  An odd run out is merged with an
+   empty one, which copies it.  Called on a pool thread.  */
+
+static void
+merge_runs (void *ctx, int i)
+{
+  struct sort_pass *pass = (struct sort_pass *) ctx;
+  int pair = i / pass->pieces;
+  int piece = i % pass->pieces;
+  int lo = pair * 2 * pass->width;
+  int mid = MIN (lo + pass->width, pass->n);
+  int hi = MIN (lo + 2 * pass->width, pass->n);
+  struct sort_key *a = pass->src + lo;
+  struct sort_key *b = pass->src + mid;
+  int m = mid - lo, n = hi - mid;
+  int k0 = (int) ((uintmax_t) (hi - lo) * piece / pass->pieces);
+  int k1 = (int) ((uintmax_t) (hi - lo) * (piece + 1) / pass->pieces);
+  int l = merge_split (a, m, b, n, k0);
+  int r = k0 - l;
+  int l_end = merge_split (a, m, b, n, k1);
+  int r_end = k1 - l_end;
+  struct sort_key *dst = pass->dst + lo + k0;
+
+  while (l < l_end && r < r_end)
+    *dst++ = (compare_stable (&b[r], &a[l]) < 0 ? b[r++] : a[l++]);
+  while (l < l_end)
+    *dst++ = a[l++];
+  while (r < r_end)
+    *dst++ = b[r++];
+}
+
+/* Sort the N keys in KEYS on up to N_THREADS threads, using TMP (N
+   more keys) as scratch space: qsort one run per thread, then merge
+   pairs of runs until one is left.  */
+
+static void
+parallel_sort_keys (struct sort_key *keys, struct sort_key *tmp, int n,
+            int n_threads)
+{
+  struct sort_pass pass;
+  struct sort_key *t;
+  int n_runs, n_pairs;
+
+  pass.src = keys;
+  pass.dst = tmp;
+  pass.n = n;
+  pass.width = (n + n_threads - 1) / n_threads;
+  n_runs = (n + pass.width - 1) / pass.width;
+
+  _ParallelFor (n_runs, n_threads, sort_run, &pass);
+
+  for (; n_runs > 1; n_runs = n_pairs)
+    {
+      n_pairs = (n_runs + 1) / 2;
+      pass.pieces = MAX (n_threads / n_pairs, 1);
+      _ParallelFor (n_pairs * pass.pieces, n_threads, merge_runs, &pass);
+      t = pass.src;
+      pass.src = pass.dst;
+      pass.dst = t;
+      pass.width *= 2;
+    }
+  if (pass.src != keys)
+    memcpy (keys, pass.src, sizeof (*keys) * n);
+}
+
+/* Return the comparator for the sort order chosen by the options,
+   or 0 for --sort=none.  */
+
+static qsort_compare_t
+choose_sort_func (void)
 {
-  typedef int (*qsort_compare_t)( const void *, const void * );
   qsort_compare_t func = NULL;
 
   switch (sort_type)
     {
     case sort_none:
-      return;
+      break;
     case sort_time:
       switch (time_type)
     {
@@ -3265,106 +4238,313 @@ sort_files (void)
     default:
       abort ();
     }
+  return func;
+}
+
+/* --top=N keeps only the first N files of each directory in sort
+   order, so its cost depends on N rather than on the directory size.
+   While print_dir reads, files[0..N-1] is a heap whose root is the
+   file that would be listed last; each new file either replaces the
+   root or is dropped.  Ties go to the file read first, as in a full
+   sort.  */
+
+static int
+top_compare (struct fileinfo *f1, struct fileinfo *f2)
+{
+  struct sort_key key1, key2;
+  int diff;
+
+  make_sort_key (&key1, f1);
+  make_sort_key (&key2, f2);
+  diff = (*sort_func) (&key1, &key2);
+  if (diff == 0)
+    diff = longdiff (f1->seq, f2->seq);
+  return diff;
+}
+
+/* Move files[I] down the heap of the first N files to its place.  */
+
+static void
+top_sift_down (int i, int n)
+{
+  struct fileinfo tmp;
+  int child;
+
+  for (; (child = 2 * i + 1) < n; i = child)
+    {
+      if (child + 1 < n && top_compare (&files[child + 1], &files[child]) > 0)
+    child++;
+      if (top_compare (&files[child], &files[i]) <= 0)
+    break;
+      tmp = files[i];
+      files[i] = files[child];
+      files[child] = tmp;
+    }
+}
+
+/* Add the file just gobbled, the SEQ'th read from this directory, to
+   the heap, dropping the worst file if that leaves more than N.  */
+
+static void
+top_add_file (unsigned long seq)
+{
+  struct fileinfo tmp;
+  int i = files_index - 1;
+  int parent;
+
+  if (seq == 0)
+    sort_func = choose_sort_func ();
+  files[i].seq = seq;
+
+  if ((unsigned long) files_index <= top_n)
+    {
+      if (sort_func)
+    for (; i > 0 && top_compare (&files[i], &files[parent = (i - 1) / 2]) > 0;
+         i = parent)
+      {
+        tmp = files[i];
+        files[i] = files[parent];
+        files[parent] = tmp;
+      }
+      return;
+    }
+
+  /* Without sorting, the first N read are the ones listed.  */
+  if (sort_func && top_compare (&files[i], &files[0]) < 0)
+    {
+      free_file (&files[0]);
+      files[0] = files[i];
+      files_index--;
+      top_sift_down (0, files_index);
+    }
+  else
+    {
+      free_file (&files[i]);
+      files_index--;
+    }
+}
+
+/* Sort the heap built by top_add_file, by taking the root off
+   repeatedly.  */
+
+static void
+top_sort_files (void)
+{
+  struct fileinfo tmp;
+  int n;
+
+  if (!sort_func)
+    return;
+  for (n = files_index - 1; n > 0; n--)
+    {
+      tmp = files[0];
+      files[0] = files[n];
+      files[n] = tmp;
+      top_sift_down (0, n);
+    }
+}
+
+/* Sort the files now in the table.  */
+
+static void
+sort_files (void)
+{
+  qsort_compare_t func = choose_sort_func ();
+  struct sort_key *keys, *tmp = 0;
+  struct fileinfo f;
+  int i, j, k;
+#ifdef WIN32
+  LARGE_INTEGER start, end;
+#endif
+
+  if (!func)
+    return;
+
+#ifdef WIN32
+  start.QuadPart = 0;
+  if (print_stats)
+    QueryPerformanceCounter (&start);
+#endif
+
+  keys = (struct sort_key *) xmalloc (sizeof (*keys) * (files_index + 1));
+  for (i = 0; i < files_index; i++)
+    make_sort_key (&keys[i], &files[i]);
+  sort_func = func;
+
+  if ((sort_type == sort_size || sort_type == sort_time)
+      && files_index >= RADIX_SORT_MIN)
+    {
+      /* Sort on the integral key, then let the comparator order each
+         run of equal keys (sub-second time, then name).  */
+      tmp = (struct sort_key *) xmalloc (sizeof (*tmp) * files_index);
+      radix_sort_keys (keys, tmp, files_index, !sort_reverse);
+#ifdef WIN32
+      sort_radix++;
+#endif
+      for (i = 0; i < files_index; i = j)
+    {
+      for (j = i + 1; j < files_index && keys[j].num == keys[i].num; j++)
+        continue;
+      if (j - i > 1)
+        qsort ( (void *)(keys + i), (size_t)(j - i), (size_t)sizeof (*keys),
+           compare_stable);
+    }
+    }
+  else if (sort_threads > 1 && files_index >= PARALLEL_SORT_MIN)
+    {
+      tmp = (struct sort_key *) xmalloc (sizeof (*tmp) * files_index);
+      parallel_sort_keys (keys, tmp, files_index, (int) sort_threads);
+#ifdef WIN32
+      sort_parallel++;
+#endif
+    }
+  else
+    qsort ( (void *)keys, (size_t)files_index, (size_t)sizeof (*keys), compare_stable); // RIVY
+
+  if (tmp)
+    free (tmp);
+
+  /* Put the files in key order in place, one cycle of the permutation
+     at a time.  Slot J takes the file that keys[J] points at; a null
+     pointer marks a slot already filled.  */
+  for (i = 0; i < files_index; i++)
+    {
+      if (!keys[i].file)
+        continue;
+      f = files[i];
+      for (j = i; ; j = k)
+        {
+          k = keys[j].file - files;
+          keys[j].file = 0;
+          if (k == i)
+            break;
+          files[j] = files[k];
+        }
+      files[j] = f;
+    }
+  free (keys);
 
-  qsort ( (void *)files, (size_t)files_index, (size_t)sizeof (struct fileinfo), func); // RIVY
+#ifdef WIN32
+  if (print_stats)
+    {
+      QueryPerformanceCounter (&end);
+      sort_ticks += end.QuadPart - start.QuadPart;
+      sort_calls++;
+      sort_count += files_index;
+    }
+#endif
 }
 
-/* Comparison routines for sorting the files. */
+/* Comparison routines for sorting the files.  Ties on the time in
+   seconds fall back to the full time (sub-second, where the stat
+   has it), then to the name.  */
 
 static int
-compare_ctime (const struct fileinfo *file1, const struct fileinfo *file2)
+compare_ctime (const struct sort_key *key1, const struct sort_key *key2)
 {
-  int diff = CTIME_CMP (file2->stat, file1->stat);
+  int diff = longdiff (key2->num, key1->num);
   if (diff == 0)
-    diff = strcoll (file1->name, file2->name);
+    diff = CTIME_CMP (key2->file->stat, key1->file->stat);
+  if (diff == 0)
+    diff = strcoll (key1->name, key2->name);
   return diff;
 }
 
 static int
-rev_cmp_ctime (const struct fileinfo *file2, const struct fileinfo *file1)
+rev_cmp_ctime (const struct sort_key *key2, const struct sort_key *key1)
 {
-  int diff = CTIME_CMP (file2->stat, file1->stat);
+  int diff = longdiff (key2->num, key1->num);
+  if (diff == 0)
+    diff = CTIME_CMP (key2->file->stat, key1->file->stat);
   if (diff == 0)
-    diff = strcoll (file1->name, file2->name);
+    diff = strcoll (key1->name, key2->name);
   return diff;
 }
 
 static int
-compare_mtime (const struct fileinfo *file1, const struct fileinfo *file2)
+compare_mtime (const struct sort_key *key1, const struct sort_key *key2)
 {
-  int diff = MTIME_CMP (file2->stat, file1->stat);
+  int diff = longdiff (key2->num, key1->num);
+  if (diff == 0)
+    diff = MTIME_CMP (key2->file->stat, key1->file->stat);
   if (diff == 0)
-    diff = strcoll (file1->name, file2->name);
+    diff = strcoll (key1->name, key2->name);
   return diff;
 }
 
 static int
-rev_cmp_mtime (const struct fileinfo *file2, const struct fileinfo *file1)
+rev_cmp_mtime (const struct sort_key *key2, const struct sort_key *key1)
 {
-  int diff = MTIME_CMP (file2->stat, file1->stat);
+  int diff = longdiff (key2->num, key1->num);
   if (diff == 0)
-    diff = strcoll (file1->name, file2->name);
+    diff = MTIME_CMP (key2->file->stat, key1->file->stat);
+  if (diff == 0)
+    diff = strcoll (key1->name, key2->name);
   return diff;
 }
 
 static int
-compare_atime (const struct fileinfo *file1, const struct fileinfo *file2)
+compare_atime (const struct sort_key *key1, const struct sort_key *key2)
 {
-  int diff = ATIME_CMP (file2->stat, file1->stat);
+  int diff = longdiff (key2->num, key1->num);
+  if (diff == 0)
+    diff = ATIME_CMP (key2->file->stat, key1->file->stat);
   if (diff == 0)
-    diff = strcoll (file1->name, file2->name);
+    diff = strcoll (key1->name, key2->name);
   return diff;
 }
 
 static int
-rev_cmp_atime (const struct fileinfo *file2, const struct fileinfo *file1)
+rev_cmp_atime (const struct sort_key *key2, const struct sort_key *key1)
 {
-  int diff = ATIME_CMP (file2->stat, file1->stat);
+  int diff = longdiff (key2->num, key1->num);
+  if (diff == 0)
+    diff = ATIME_CMP (key2->file->stat, key1->file->stat);
   if (diff == 0)
-    diff = strcoll (file1->name, file2->name);
+    diff = strcoll (key1->name, key2->name);
   return diff;
 }
 
 static int
-compare_size (const struct fileinfo *file1, const struct fileinfo *file2)
+compare_size (const struct sort_key *key1, const struct sort_key *key2)
 {
-  int diff = longdiff (file2->stat.st_size, file1->stat.st_size);
+  int diff = longdiff (key2->num, key1->num);
   if (diff == 0)
-    diff = strcoll (file1->name, file2->name);
+    diff = strcoll (key1->name, key2->name);
   return diff;
 }
 
 static int
-rev_cmp_size (const struct fileinfo *file2, const struct fileinfo *file1)
+rev_cmp_size (const struct sort_key *key2, const struct sort_key *key1)
 {
-  int diff = longdiff (file2->stat.st_size, file1->stat.st_size);
+  int diff = longdiff (key2->num, key1->num);
   if (diff == 0)
-    diff = strcoll (file1->name, file2->name);
+    diff = strcoll (key1->name, key2->name);
   return diff;
 }
 
 static int
-compare_version (const struct fileinfo *file1, const struct fileinfo *file2)
+compare_version (const struct sort_key *key1, const struct sort_key *key2)
 {
-  return strverscmp (file1->name, file2->name);
+  return strverscmp (key1->name, key2->name);
 }
 
 static int
-rev_cmp_version (const struct fileinfo *file2, const struct fileinfo *file1)
+rev_cmp_version (const struct sort_key *key2, const struct sort_key *key1)
 {
-  return strverscmp (file1->name, file2->name);
+  return strverscmp (key1->name, key2->name);
 }
 
 static int
-compare_name (const struct fileinfo *file1, const struct fileinfo *file2)
+compare_name (const struct sort_key *key1, const struct sort_key *key2)
 {
-  return strcoll (file1->name, file2->name);
+  return strcoll (key1->name, key2->name);
 }
 
 static int
-rev_cmp_name (const struct fileinfo *file2, const struct fileinfo *file1)
+rev_cmp_name (const struct sort_key *key2, const struct sort_key *key1)
 {
-  return strcoll (file1->name, file2->name);
+  return strcoll (key1->name, key2->name);
 }
 
 //
@@ -3373,7 +4553,7 @@ rev_cmp_name (const struct fileinfo *file2, const struct fileinfo *file1)
 // For Unix afficanados who like "Makefile" first.
 //
 static int
-compare_case_sensitive (const struct fileinfo *file1, const struct fileinfo *file2)
+compare_case_sensitive (const struct sort_key *key1, const struct sort_key *key2)
 {
 #ifdef WIN32
   //
@@ -3381,8 +4561,8 @@ compare_case_sensitive (const struct fileinfo *file1, const struct fileinfo *fil
   //
   // Re-implement _mbscoll manually.
   //
-  unsigned char *s1 = (unsigned char *)file1->name;
-  unsigned char *s2 = (unsigned char *)file2->name;
+  unsigned char *s1 = (unsigned char *)key1->name;
+  unsigned char *s2 = (unsigned char *)key2->name;
 
   int mbch1, mbch2;
   for (; *s1 && *s2; s1 = _mbsinc(s1), s2 = _mbsinc(s2)) {
@@ -3399,58 +4579,58 @@ compare_case_sensitive (const struct fileinfo *file1, const struct fileinfo *fil
     }
   }
   // No case-only differences at this point
-  return _mbsicoll(file1->name, file2->name);
+  return _mbsicoll(key1->name, key2->name);
 #else
-  return _mbscoll(file1->name, file2->name);
+  return _mbscoll(key1->name, key2->name);
 #endif
 }
 
 static int
-rev_cmp_case_sensitive (const struct fileinfo *file2, const struct fileinfo *file1)
+rev_cmp_case_sensitive (const struct sort_key *key2, const struct sort_key *key1)
 {
-  return compare_case_sensitive (file1, file2);
+  return compare_case_sensitive (key1, key2);
 }
 
 /* Compare file extensions.  Files with no extension are `smallest'.
    If extensions are the same, compare by filenames instead. */
 
 static int
-compare_extension (const struct fileinfo *file1, const struct fileinfo *file2)
+compare_extension (const struct sort_key *key1, const struct sort_key *key2)
 {
-  register char *base1, *base2;
+  register const char *base1, *base2;
   register int cmp;
 
-  base1 = strrchr (file1->name, '.');
-  base2 = strrchr (file2->name, '.');
+  base1 = key1->ext;
+  base2 = key2->ext;
   if (base1 == 0 && base2 == 0)
-    return strcoll (file1->name, file2->name);
+    return strcoll (key1->name, key2->name);
   if (base1 == 0)
     return -1;
   if (base2 == 0)
     return 1;
   cmp = strcoll (base1, base2);
   if (cmp == 0)
-    return strcoll (file1->name, file2->name);
+    return strcoll (key1->name, key2->name);
   return cmp;
 }
 
 static int
-rev_cmp_extension (const struct fileinfo *file2, const struct fileinfo *file1)
+rev_cmp_extension (const struct sort_key *key2, const struct sort_key *key1)
 {
-  register char *base1, *base2;
+  register const char *base1, *base2;
   register int cmp;
 
-  base1 = strrchr (file1->name, '.');
-  base2 = strrchr (file2->name, '.');
+  base1 = key1->ext;
+  base2 = key2->ext;
   if (base1 == 0 && base2 == 0)
-    return strcoll (file1->name, file2->name);
+    return strcoll (key1->name, key2->name);
   if (base1 == 0)
     return -1;
   if (base2 == 0)
     return 1;
   cmp = strcoll (base1, base2);
   if (cmp == 0)
-    return strcoll (file1->name, file2->name);
+    return strcoll (key1->name, key2->name);
   return cmp;
 }
 
@@ -3879,7 +5059,7 @@ print_long_format (const struct fileinfo *f)
 
   DIRED_INDENT ();
   DIRED_FPUTS (buf, stdmore, p - buf);
-  print_name_with_quoting (f->name, FILE_OR_LINK_MODE (f), f->linkok,
+  print_name_with_quoting (f->name, f, FILE_OR_LINK_MODE (f), f->linkok,
                &dired_obstack);
 
   if (f->filetype == symbolic_link)
@@ -3887,7 +5067,7 @@ print_long_format (const struct fileinfo *f)
       if (f->linkname)
     {
       DIRED_FPUTS_LITERAL (" -> ", stdmore);
-      print_name_with_quoting (f->linkname, f->linkmode, f->linkok - 1,
+      print_name_with_quoting (f->linkname, 0, f->linkmode, f->linkok - 1,
                    NULL);
       if (indicator_style != none)
             print_type_indicator (&((struct fileinfo *)f)->stat, f->linkmode);  // RIVY
@@ -3897,24 +5077,26 @@ print_long_format (const struct fileinfo *f)
     print_type_indicator (&((struct fileinfo *)f)->stat, f->stat.st_mode);     // RIVY
 }
 
-/* Output to OUT a quoted representation of the file name NAME,
-   using OPTIONS to control quoting.  Produce no output if OUT is NULL.
-   Return the number of screen columns occupied by NAME's quoted
-   representation.  */
+/* Put a quoted representation of the file name NAME into SMALLBUF
+   (SMALLSIZE bytes), using OPTIONS to control quoting, or into a
+   malloc'd buffer if it does not fit.  Return the buffer, with the
+   representation's length in *PLEN and the number of screen columns
+   it occupies in *PWIDTH.  */
 
-static size_t
-quote_name (MORE *out, const char *name, struct quoting_options const *options)
+static char *
+quote_name_buffer (char *smallbuf, size_t smallsize, const char *name,
+           struct quoting_options const *options,
+           size_t *plen, int *pwidth)
 {
-  char smallbuf[BUFSIZ];
-  size_t len = quotearg_buffer (smallbuf, sizeof smallbuf, name, -1, options);
+  size_t len = quotearg_buffer (smallbuf, smallsize, name, -1, options);
   char *buf;
   int displayed_width;
 
-  if (len < sizeof smallbuf)
+  if (len < smallsize)
     buf = smallbuf;
   else
     {
-      buf = (char *) alloca (len + 1);
+      buf = (char *) xmalloc (len + 1);
       quotearg_buffer (buf, len + 1, name, -1, options);
     }
 
@@ -4063,14 +5245,63 @@ quote_name (MORE *out, const char *name, struct quoting_options const *options)
   }
 #endif
 
+  buf[len] = '\0';
+  *plen = len;
+  *pwidth = displayed_width;
+  return buf;
+}
+
+/* Output to OUT a quoted representation of the file name NAME,
+   using OPTIONS to control quoting.  Produce no output if OUT is NULL.
+   Return the number of screen columns occupied by NAME's quoted
+   representation.  */
+
+static size_t
+quote_name (MORE *out, const char *name, struct quoting_options const *options)
+{
+  char smallbuf[BUFSIZ];
+  size_t len;
+  int displayed_width;
+  char *buf = quote_name_buffer (smallbuf, sizeof smallbuf, name, options,
+                 &len, &displayed_width);
+
   if (out != NULL)
     more_fwrite (buf, 1, len, out); // AEK
+  if (buf != smallbuf)
+    free (buf);
   return displayed_width;
 }
 
+/* Return the number of screen columns that F's quoted name occupies.
+   The first call quotes the name and keeps the result in F, so that
+   the column layout and the printing share one quoting per file.  */
+
+static int
+file_name_width (const struct fileinfo *f)
+{
+  struct fileinfo *file = (struct fileinfo *) f; /* cache only */
+  char smallbuf[BUFSIZ];
+  size_t len;
+  char *buf;
+
+  if (file->name_width >= 0)
+    return file->name_width;
+
+  buf = quote_name_buffer (smallbuf, sizeof smallbuf, file->name,
+               filename_quoting_options, &len, &file->name_width);
+  if (strcmp (buf, file->name) != 0)
+    file->quoted_name = buf == smallbuf ? xstrdup (buf) : buf;
+  else if (buf != smallbuf)
+    free (buf);
+  return file->name_width;
+}
+
+/* Print the file name P with quoting.  If P is the name of file F,
+   rather than a link target, use F's quoting from file_name_width.  */
+
 static void
-print_name_with_quoting (const char *p, unsigned int mode, int linkok,
-             struct obstack *stack)
+print_name_with_quoting (const char *p, const struct fileinfo *f,
+             unsigned int mode, int linkok, struct obstack *stack)
 {
   if (print_with_color)
     print_color_indicator (p, mode, linkok);
@@ -4078,7 +5309,16 @@ print_name_with_quoting (const char *p, unsigned int mode, int linkok,
   if (stack)
     PUSH_CURRENT_DIRED_POS (stack);
 
-  dired_pos += quote_name (stdmore, p, filename_quoting_options);
+  if (f)
+    {
+      const char *q;
+
+      dired_pos += file_name_width (f);
+      q = f->quoted_name ? f->quoted_name : f->name;
+      more_fwrite (q, 1, strlen (q), stdmore);
+    }
+  else
+    dired_pos += quote_name (stdmore, p, filename_quoting_options);
 
   if (stack)
     PUSH_CURRENT_DIRED_POS (stack);
@@ -4119,7 +5359,8 @@ print_file_name_and_frills (const struct fileinfo *f)
                     ST_NBLOCKSIZE, output_block_size,
                     human_ceiling));
 
-  print_name_with_quoting (f->name, FILE_OR_LINK_MODE (f), f->linkok, NULL);
+  print_name_with_quoting (f->name, f, FILE_OR_LINK_MODE (f), f->linkok,
+               NULL);
 
   if (indicator_style != none)
     print_type_indicator (&((struct fileinfo *)f)->stat, f->stat.st_mode);     // RIVY
@@ -4583,7 +5824,7 @@ length_of_file_name_and_frills (const struct fileinfo *f)
   if (print_block_size)
     len += 1 + block_size_size;
 
-  len += quote_name (NULL, f->name, filename_quoting_options);
+  len += file_name_width (f);
 
   if (indicator_style != none)
     {
@@ -4619,7 +5860,6 @@ length_of_file_name_and_frills (const struct fileinfo *f)
 static void
 print_many_per_line (void)
 {
-  struct column_info *line_fmt;
   int filesno;          /* Index into files. */
   int row;              /* Current row. */
   int max_name_length;  /* Length of longest file name + frills. */
@@ -4627,46 +5867,8 @@ print_many_per_line (void)
   int pos;              /* Current character column. */
   int cols;             /* Number of files across. */
   int rows;             /* Maximum number of files down. */
-  int max_cols;
-
-  /* Normally the maximum number of columns is determined by the
-     screen width.  But if few files are available this might limit it
-     as well.  */
-  max_cols = max_idx > files_index ? files_index : max_idx;
-
-  /* Compute the maximum number of possible columns.  */
-  for (filesno = 0; filesno < files_index; ++filesno)
-    {
-      int i;
-
-      name_length = length_of_file_name_and_frills (files + filesno);
-
-      for (i = 0; i < max_cols; ++i)
-    {
-      if (column_info[i].valid_len)
-        {
-          int idx = filesno / ((files_index + i) / (i + 1));
-          int real_length = name_length + (idx == i ? 0 : 2);
 
-          if (real_length > column_info[i].col_arr[idx])
-        {
-          column_info[i].line_len += (real_length
-                       - column_info[i].col_arr[idx]);
-          column_info[i].col_arr[idx] = real_length;
-          column_info[i].valid_len = column_info[i].line_len < line_length;
-        }
-        }
-    }
-    }
-
-  /* Find maximum allowed columns.  */
-  for (cols = max_cols; cols > 1; --cols)
-    {
-      if (column_info[cols - 1].valid_len)
-    break;
-    }
-
-  line_fmt = &column_info[cols - 1];
+  cols = choose_columns (1);
 
   /* Calculate the number of rows that will be in each column except possibly
      for a short column on the right. */
@@ -4681,8 +5883,8 @@ print_many_per_line (void)
       while (1)
     {
       print_file_name_and_frills (files + filesno);
-      name_length = length_of_file_name_and_frills (files + filesno);
-      max_name_length = line_fmt->col_arr[col++];
+      name_length = name_widths[filesno];
+      max_name_length = column_widths[col++];
 
       filesno += rows;
       if (filesno >= files_index)
@@ -4698,60 +5900,20 @@ print_many_per_line (void)
 static void
 print_horizontal (void)
 {
-  struct column_info *line_fmt;
   int filesno;
   int max_name_length;
   int name_length;
   int cols;
   int pos;
-  int max_cols;
-
-  /* Normally the maximum number of columns is determined by the
-     screen width.  But if few files are available this might limit it
-     as well.  */
-  max_cols = max_idx > files_index ? files_index : max_idx;
 
-  /* Compute the maximum file name length.  */
-  max_name_length = 0;
-  for (filesno = 0; filesno < files_index; ++filesno)
-    {
-      int i;
-
-      name_length = length_of_file_name_and_frills (files + filesno);
-
-      for (i = 0; i < max_cols; ++i)
-    {
-      if (column_info[i].valid_len)
-        {
-          int idx = filesno % (i + 1);
-          int real_length = name_length + (idx == i ? 0 : 2);
-
-          if (real_length > column_info[i].col_arr[idx])
-        {
-          column_info[i].line_len += (real_length
-                       - column_info[i].col_arr[idx]);
-          column_info[i].col_arr[idx] = real_length;
-          column_info[i].valid_len = column_info[i].line_len < line_length;
-        }
-        }
-    }
-    }
-
-  /* Find maximum allowed columns.  */
-  for (cols = max_cols; cols > 1; --cols)
-    {
-      if (column_info[cols - 1].valid_len)
-    break;
-    }
-
-  line_fmt = &column_info[cols - 1];
+  cols = choose_columns (0);
 
   pos = 0;
 
   /* Print first entry.  */
   print_file_name_and_frills (files);
-  name_length = length_of_file_name_and_frills (files);
-  max_name_length = line_fmt->col_arr[0];
+  name_length = name_widths[0];
+  max_name_length = column_widths[0];
 
   /* Now the rest.  */
   for (filesno = 1; filesno < files_index; ++filesno)
@@ -4771,8 +5933,8 @@ print_horizontal (void)
 
       print_file_name_and_frills (files + filesno);
 
-      name_length = length_of_file_name_and_frills (files + filesno);
-      max_name_length = line_fmt->col_arr[col];
+      name_length = name_widths[filesno];
+      max_name_length = column_widths[col];
     }
   more_putchar ('\n');
 }
@@ -4859,36 +6021,98 @@ attach (char *dest, const char *dirname, const char *name)
   *dest = 0;
 }
 
+/* Set up the column layout for the files now in the table: find
+   the most columns that fit the line, and measure each file name
+   (once, since the search and the printing both need them).  */
+
 static void
 init_column_info (void)
 {
   int i;
-  int allocate = 0;
 
   max_idx = line_length / MIN_COLUMN_WIDTH;
   if (max_idx == 0)
     max_idx = 1;
 
-  if (column_info == NULL)
+  if (column_widths == NULL)
+    column_widths = (int *) xmalloc (max_idx * sizeof (int));
+
+  if (n_name_widths < files_index)
     {
-      column_info = (struct column_info *) xmalloc (max_idx
-                            * sizeof (struct column_info));
-      allocate = 1;
+      n_name_widths = nfiles;
+      name_widths = (int *) xrealloc (name_widths,
+                      n_name_widths * sizeof (int));
     }
 
-  for (i = 0; i < max_idx; ++i)
+  total_name_width = 0;
+  for (i = 0; i < files_index; i++)
     {
-      int j;
+      name_widths[i] = length_of_file_name_and_frills (files + i);
+      total_name_width += name_widths[i];
+    }
+}
 
-      column_info[i].valid_len = 1;
-      column_info[i].line_len = (i + 1) * MIN_COLUMN_WIDTH;
+/* Compute column_widths for COLS columns, filled down the columns
+   if BY_COLUMNS, else across the rows.  Each column is as wide as
+   its widest name, plus 2 for all but the last, and at least
+   MIN_COLUMN_WIDTH.  Return nonzero if the line fits, stopping as
+   soon as it cannot.  */
 
-      if (allocate)
-    column_info[i].col_arr = (int *) xmalloc ((i + 1) * sizeof (int));
+static int
+fit_columns (int cols, int by_columns)
+{
+  int rows = (files_index + cols - 1) / cols;
+  int line_len = cols * MIN_COLUMN_WIDTH;
+  int filesno;
+  int i;
+
+  for (i = 0; i < cols; i++)
+    column_widths[i] = MIN_COLUMN_WIDTH;
+
+  for (filesno = 0; filesno < files_index; filesno++)
+    {
+      int idx = by_columns ? filesno / rows : filesno % cols;
+      int real_length = name_widths[filesno] + (idx == cols - 1 ? 0 : 2);
+
+      if (real_length > column_widths[idx])
+    {
+      line_len += real_length - column_widths[idx];
+      column_widths[idx] = real_length;
+      if (line_len >= line_length)
+        return 0;
+    }
+    }
+  return 1;
+}
+
+/* Return the most columns, up to one per file, that the files fit in
+   (but at least one), and leave their widths in column_widths.
+
+   Whether a count fits does not shrink steadily with the count, so
+   each count is tried from the most down, as GNU ls does.  But most
+   counts are ruled out without a pass over the names: a column is at
+   least as wide as the average of its names, and there are no more
+   than ROWS names in a column, so the line is at least the total
+   width of the names divided by ROWS.  The rest stop at the first
+   column that overflows the line.  */
+
+static int
+choose_columns (int by_columns)
+{
+  int max_cols = max_idx > files_index ? files_index : max_idx;
+  int cols;
+
+  for (cols = max_cols; cols > 1; --cols)
+    {
+      uintmax_t rows = (files_index + cols - 1) / cols;
+      uintmax_t least = total_name_width + 2 * (files_index - rows);
 
-      for (j = 0; j <= i; ++j)
-    column_info[i].col_arr[j] = MIN_COLUMN_WIDTH;
+      if (least < line_length * rows && fit_columns (cols, by_columns))
+    return cols;
     }
+
+  fit_columns (1, by_columns);
+  return 1;
 }
 
 void
@@ -4922,6 +6146,9 @@ Get the latest version at https://u-tools.com/msls\n")); // AEK
                                with -l: show ctime and sort by name\n\
                                otherwise: sort by ctime\n\
   -C                         list entries by columns\n\
+      --cache-mem=SIZE       limit the directory cache to about SIZE bytes\n\
+                               (k, M, G suffixes ok), evicting the least\n\
+                               recently used directories\n\
       --color[=WHEN]         control whether color is used to distinguish file\n\
                                types.  WHEN may be `never', `always', or `auto'\n\
       --compressed           indicate compressed files with distinct color\n\
@@ -4947,7 +6174,9 @@ Get the latest version at https://u-tools.com/msls\n")); // AEK
   -i, --inode                print index number of each file\n\
   -I, --ignore=PATTERN       do not list implied entries matching shell PATTERN\n\
       --indicator-style=WORD append indicator with style WORD to entry names:\n\
-                               none (default), classify (-F), file-type (-p)\n"));
+                               none (default), classify (-F), file-type (-p)\n\
+      --jobs=N               read up to N directories ahead at once when\n\
+                               listing several (-R); 1-64, default 1\n"));
       more_printf (_("\
   -k, --kilobytes            like --block-size=1024\n\
   -K, --registry             show registry keys: hklm, hkcu, hku, hkcr\n\
@@ -4964,7 +6193,9 @@ Get the latest version at https://u-tools.com/msls\n")); // AEK
       --oem-cp               use the OEM code page for output\n\
   -p, --file-type            append indicator (one of \\@$) to entries\n\
       --phys-size            report the physical size if the file is\n\
-                               compressed or sparse\n"));
+                               compressed or sparse\n\
+      --prefetch=N           read up to N queued directories in the\n\
+                               background while listing (-R); 0-64\n"));
       more_printf (_("\
   -q, --hide-control-chars   print ? instead of non graphic characters\n\
       --show-control-chars   show non graphic characters as-is (default\n\
@@ -4980,7 +6211,11 @@ Get the latest version at https://u-tools.com/msls\n")); // AEK
       --short-names          show short 8.3 letter file names, a la MS-DOS\n\
       --sids[=STYLE]         show file owner Security Identifiers (SIDs):\n\
                                STYLE may be `long', `short', or `none'.  See -n\n\
-  -s, --size                 print size of each file in blocks\n"));
+  -s, --size                 print size of each file in blocks\n\
+      --stat-cache=N         cache at most N files named by path (0=no limit)\n\
+      --stats                print cache statistics, the cost of -I and -B,\n\
+                               sort time and peak memory use to stderr on\n\
+                               exit\n"));
       more_printf (_("\
   -S                         sort by file size\n\
       --slow                 get extended information from slow media such as\n\
@@ -4988,8 +6223,14 @@ Get the latest version at https://u-tools.com/msls\n")); // AEK
       --sort=WORD            sort by: none -U, size -S, time -t,\n\
                                version -v, extension -X, case\n\
                                status -c, time -t, atime -u, access -u, use -u\n\
+      --streaming            read directories incrementally; with -1U print\n\
+                               each entry as soon as it is read\n\
       --streams[=y/n]        report files containing streams (-F -p --color)\n\
                                with -l: print the names of the streams\n\
+      --sort-threads=N       sort very large directories on N threads (1-64;\n\
+                               default: one per processor)\n\
+      --threads=N            fetch inode, --phys-size and --short-names info\n\
+                               for up to N files at once (1-64)\n\
       --time=WORD            show time as WORD instead of modification time:\n\
                                atime, access, use, or ctime (creation time)\n\
                                specified time is sort key if --sort=time\n"));
@@ -5005,6 +6246,8 @@ Get the latest version at https://u-tools.com/msls\n")); // AEK
   -t                         sort by modification time\n\
   -T, --tabsize=COLS         assume tab stops at each COLS instead of 8\n\
       --token                show the process token\n\
+      --top=N                list only the first N entries of each\n\
+                               directory, in sort order\n\
   -u                         with -lt: sort by, and show, access time\n\
                                with -l: show access time and sort by name\n\
                                otherwise: sort by access time\n\
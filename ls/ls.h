@@ -78,6 +78,24 @@ extern ACLS_FORMAT acls_format; // AEK
 
 ///////////////////////////////////////////////////////////////////
 
+//
+// Optional per-file queries that the chosen output actually uses.
+// Worked out once by plan_queries() in ls.c; dirent.c and the
+// security code skip any query whose bit is clear.  (The name,
+// attributes, size and times come with every FindFirst/FindNext,
+// so they are always fetched.)
+//
+enum query_bits
+{
+  QUERY_FULL_INFO=0x01, // inode, link count, volume serial #
+  QUERY_SECURITY=0x02,  // owner, group, ACL-based mode bits
+  QUERY_STREAMS=0x04    // alternate data streams
+};
+
+extern unsigned int query_plan;
+
+///////////////////////////////////////////////////////////////////
+
 extern char *view_as;
 
 #ifdef __cplusplus